@@ -0,0 +1,292 @@
+/* Draws every layout and presses every key of it without a compositor, to
+ * profile rendering and event emission in isolation. Built by `make bench`.
+ *
+ * It also replays touches through kbd_get_key against a scan of every key,
+ * and times key fills with pixman against the cairo path they replaced.
+ *
+ * usage: wvkbd-bench-<layout> [iterations] [width]
+ * Set WVKBD_BENCH_LOG to log every event that would have been sent. */
+#include <linux/input-event-codes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "keyboard.h"
+#include "config.h"
+
+/* array size */
+#define countof(x) (sizeof(x) / sizeof(*x))
+
+static const double scales[] = {1.0, 1.5, 2.0, 3.0};
+
+#define BENCH_TOUCHES 4096
+/* fill benchmark: surface size and grid of keys */
+#define BENCH_FILL_W 1080
+#define BENCH_FILL_H 700
+#define BENCH_FILL_COLS 10
+#define BENCH_FILL_ROWS 5
+
+static struct drw draw_ctx; // no wl_shm: surfaces draw into plain memory
+static struct drwbuf draw_surf_back_buffer, draw_surf_display_buffer,
+    popup_draw_surf_back_buffer, popup_draw_surf_display_buffer;
+static struct drwsurf draw_surf, popup_draw_surf;
+static struct drwbuf fill_surf_back_buffer, fill_surf_display_buffer;
+static struct drwsurf fill_surf;
+static struct kbd_recorder recorder;
+static struct kbd keyboard;
+
+static double
+now_us(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* the hit test as it was before rows were indexed: every key in turn */
+static struct key *
+linear_get_key(struct layout *l, uint32_t x, uint32_t y)
+{
+    for (struct key *k = l->keys; k->type != Last; k++) {
+        if ((k->type != EndRow) && (k->type != Pad) && (x >= k->x) &&
+            (y >= k->y) && (x < k->x + k->w) && (y < k->y + k->h)) {
+            return k;
+        }
+    }
+    return NULL;
+}
+
+static void
+bench_hit_test(size_t index, int iterations)
+{
+    struct layout *l = &layouts[index];
+    const char *name = l->name;
+    char unnamed[32];
+    if (!name) {
+        snprintf(unnamed, sizeof(unnamed), "#%zu", index);
+        name = unnamed;
+    }
+    keyboard.layout = l;
+
+    // the same pseudo-random touches for every layout and both lookups
+    static uint32_t xs[BENCH_TOUCHES], ys[BENCH_TOUCHES];
+    uint32_t seed = 1;
+    for (int i = 0; i < BENCH_TOUCHES; i++) {
+        seed = seed * 1103515245 + 12345;
+        xs[i] = (seed >> 8) % keyboard.w;
+        seed = seed * 1103515245 + 12345;
+        ys[i] = (seed >> 8) % keyboard.h;
+    }
+
+    int mismatches = 0;
+    for (int i = 0; i < BENCH_TOUCHES; i++) {
+        if (kbd_get_key(&keyboard, xs[i], ys[i]) !=
+            linear_get_key(l, xs[i], ys[i]))
+            mismatches++;
+    }
+
+    // keep the results so the lookups can't be optimised away
+    volatile uintptr_t sink = 0;
+    double touches = (double)iterations * BENCH_TOUCHES;
+    double t0 = now_us();
+    for (int n = 0; n < iterations; n++)
+        for (int i = 0; i < BENCH_TOUCHES; i++)
+            sink += (uintptr_t)kbd_get_key(&keyboard, xs[i], ys[i]);
+    double rows_ns = (now_us() - t0) * 1e3 / touches;
+
+    t0 = now_us();
+    for (int n = 0; n < iterations; n++)
+        for (int i = 0; i < BENCH_TOUCHES; i++)
+            sink += (uintptr_t)linear_get_key(l, xs[i], ys[i]);
+    double linear_ns = (now_us() - t0) * 1e3 / touches;
+
+    printf("%-20s hit test  rows %7.1f ns  linear %7.1f ns  x%.1f%s\n", name,
+           rows_ns, linear_ns, rows_ns > 0 ? linear_ns / rows_ns : 0.0,
+           mismatches ? "  MISMATCH" : "");
+}
+
+/* a square fill as it was before pixman: a cairo path filled with SOURCE */
+static void
+cairo_fill_cell(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
+                uint32_t w, uint32_t h)
+{
+    cairo_t *cr = ds->back_buffer->cairo;
+    cairo_save(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_rgba(cr, color.bgra[2] / (double)255,
+                          color.bgra[1] / (double)255,
+                          color.bgra[0] / (double)255,
+                          color.bgra[3] / (double)255);
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_fill(cr);
+    cairo_restore(cr);
+}
+
+/* One frame of keys: the cell of each is filled square with the background,
+ * then rounded keys get their inset on top, which always goes through
+ * cairo. Returns the time per frame in us. */
+static double
+bench_fill_frame(bool use_pixman, bool rounded, int iterations)
+{
+    struct drwsurf *ds = &fill_surf;
+    struct clr_scheme *scheme = &schemes[0];
+    uint32_t pixel = drw_premultiply(scheme->bg);
+    uint32_t w = BENCH_FILL_W / BENCH_FILL_COLS;
+    uint32_t h = BENCH_FILL_H / BENCH_FILL_ROWS;
+
+    double t0 = now_us();
+    for (int n = 0; n < iterations; n++) {
+        for (uint32_t r = 0; r < BENCH_FILL_ROWS; r++) {
+            for (uint32_t c = 0; c < BENCH_FILL_COLS; c++) {
+                if (use_pixman)
+                    drwbuf_fill_pixels(ds, ds->back_buffer, c * w, r * h, w,
+                                       h, pixel);
+                else
+                    cairo_fill_cell(ds, scheme->bg, c * w, r * h, w, h);
+                if (rounded)
+                    draw_inset(ds, c * w, r * h, w, h, KBD_KEY_BORDER,
+                               scheme->fg, scheme->rounding);
+            }
+        }
+    }
+    return (now_us() - t0) / iterations;
+}
+
+static void
+bench_fills(int iterations)
+{
+    fill_surf.ctx = &draw_ctx;
+    fill_surf.back_buffer = &fill_surf_back_buffer;
+    fill_surf.display_buffer = &fill_surf_display_buffer;
+    drwsurf_resize(&fill_surf, BENCH_FILL_W, BENCH_FILL_H, 1.0);
+
+    for (int rounded = 0; rounded <= 1; rounded++) {
+        double cairo_us = bench_fill_frame(false, rounded, iterations);
+        double pixman_us = bench_fill_frame(true, rounded, iterations);
+        printf("fill %dx%d %-8s cairo %9.1f us  pixman %9.1f us  x%.1f\n",
+               BENCH_FILL_W, BENCH_FILL_H, rounded ? "rounded" : "opaque",
+               cairo_us, pixman_us, pixman_us > 0 ? cairo_us / pixman_us : 0.0);
+    }
+}
+
+static void
+bench_layout(size_t index, double scale, int iterations)
+{
+    struct layout *l = &layouts[index];
+    const char *name = l->name;
+    char unnamed[32];
+    if (!name) {
+        snprintf(unnamed, sizeof(unnamed), "#%zu", index);
+        name = unnamed;
+    }
+
+    // switching uploads the keymap if needed and draws the layout once
+    double t0 = now_us();
+    kbd_switch_layout(&keyboard, l, keyboard.layer_index);
+    double switch_us = now_us() - t0;
+
+    // a cold draw renders every key and label again, a cached one copies the
+    // saved layout image back
+    double draw_us = 0;
+    for (int i = 0; i < iterations; i++) {
+        kbd_flush_layout_images(&keyboard);
+        drwsurf_flush_caches(keyboard.surf);
+        drwsurf_flush_caches(&keyboard.suggest_strip);
+        keyboard.suggest_strip_valid = false;
+        t0 = now_us();
+        kbd_draw_layout(&keyboard);
+        draw_us += now_us() - t0;
+    }
+    draw_us /= iterations;
+
+    t0 = now_us();
+    for (int i = 0; i < iterations; i++)
+        kbd_draw_layout(&keyboard);
+    double cached_us = (now_us() - t0) / iterations;
+
+    recorder.keys = recorder.modifiers = recorder.keymaps = 0;
+    uint32_t time = 0;
+    int presses = 0;
+    t0 = now_us();
+    for (int i = 0; i < iterations; i++) {
+        for (struct key *k = l->keys; k->type != Last; k++) {
+            if (k->type != Code)
+                continue;
+            kbd_press_key(&keyboard, k, time++);
+            kbd_release_key(&keyboard, time++);
+            presses++;
+        }
+    }
+    double keys_us = now_us() - t0;
+    uint32_t events = recorder.keys + recorder.modifiers + recorder.keymaps;
+
+    printf("%-20s x%.1f  switch %9.1f us  draw %9.1f us  cached %9.1f us",
+           name, scale, switch_us, draw_us, cached_us);
+    if (presses)
+        printf("  key %7.2f us  event %6.2f us (%u key, %u mods, %u keymap)",
+               keys_us / presses, events ? keys_us / events : 0.0,
+               recorder.keys, recorder.modifiers, recorder.keymaps);
+    printf("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    int iterations = 100;
+    uint32_t width = 720;
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (argc > 2)
+        width = atoi(argv[2]);
+    if (iterations < 1)
+        iterations = 1;
+
+    if (getenv("WVKBD_BENCH_LOG"))
+        recorder.log = stderr;
+
+    draw_surf.ctx = &draw_ctx;
+    draw_surf.back_buffer = &draw_surf_back_buffer;
+    draw_surf.display_buffer = &draw_surf_display_buffer;
+    popup_draw_surf.ctx = &draw_ctx;
+    popup_draw_surf.back_buffer = &popup_draw_surf_back_buffer;
+    popup_draw_surf.display_buffer = &popup_draw_surf_display_buffer;
+
+    keyboard.layers = (enum layout_id *)&layers;
+    keyboard.landscape_layers = (enum layout_id *)&landscape_layers;
+    keyboard.schemes = schemes;
+    keyboard.landscape = false;
+    keyboard.suggest_height = KBD_SUGGEST_HEIGHT;
+    keyboard.surf = &draw_surf;
+    keyboard.popup_surf = &popup_draw_surf;
+    keyboard.recorder = &recorder;
+    #ifdef SHIFT_SPACE_IS_TAB
+    keyboard.shift_space_is_tab = true;
+    #endif
+
+    for (size_t i = 0; i < countof(schemes); i++) {
+        schemes[i].font_description =
+            pango_font_description_from_string(schemes[i].font);
+    }
+
+    kbd_init(&keyboard, (struct layout *)&layouts, NULL, NULL);
+    keyboard.trail_enabled = false;
+
+    bench_fills(iterations);
+
+    for (size_t s = 0; s < countof(scales); s++) {
+        keyboard.w = width;
+        keyboard.h = KBD_PIXEL_HEIGHT + KBD_SUGGEST_HEIGHT;
+        keyboard.scale = scales[s];
+        kbd_resize(&keyboard, layouts, NumLayouts);
+
+        // hit testing works in surface coordinates, the scale doesn't matter
+        if (s == 0) {
+            for (size_t i = 0; i < NumLayouts; i++)
+                bench_hit_test(i, iterations);
+        }
+        for (size_t i = 0; i < NumLayouts; i++)
+            bench_layout(i, scales[s], iterations);
+    }
+
+    return 0;
+}
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <pixman.h>
 #include <sys/mman.h>
 #include <unistd.h>
 #include <wayland-client.h>
@@ -6,16 +8,21 @@
 #include "shm_open.h"
 #include "math.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 void drwbuf_handle_release(void *data, struct wl_buffer *wl_buffer) {
-    struct drwsurf *ds = data;
-    ds->released = true;
+    struct drwbuf *db = data;
+    db->busy = false;
 };
 
 const struct wl_buffer_listener buffer_listener = {
     .release = drwbuf_handle_release
 };
 
+extern const struct wl_callback_listener frame_listener;
+
 void drwsurf_handle_frame_cb(void* data, struct wl_callback* callback,
     uint32_t time)
 {
@@ -23,6 +30,34 @@ void drwsurf_handle_frame_cb(void* data, struct wl_callback* callback,
     wl_callback_destroy(ds->frame_cb);
     ds->frame_cb = NULL;
 
+    if (ds->render_pending && ds->render) {
+        ds->render_pending = false;
+        ds->rendering = true;
+        ds->render(ds->render_data);
+        ds->rendering = false;
+    }
+
+    // the hook asked for another frame: request it with this commit
+    if (ds->render_pending) {
+        ds->frame_cb = wl_surface_frame(ds->surf);
+        wl_callback_add_listener(ds->frame_cb, &frame_listener, ds);
+        if (cairo_region_is_empty(ds->damage))
+            wl_surface_commit(ds->surf);
+    }
+    drwsurf_present(ds);
+}
+
+const struct wl_callback_listener frame_listener = {
+    .done = drwsurf_handle_frame_cb
+};
+
+/* post the damage drawn so far and show the back buffer right away */
+void
+drwsurf_present(struct drwsurf *ds)
+{
+    if (!ds->attached || cairo_region_is_empty(ds->damage))
+        return;
+
     cairo_rectangle_int_t r = {0};
     for (int i = 0; i < cairo_region_num_rectangles(ds->damage); i++) {
         cairo_region_get_rectangle(ds->damage, i, &r);
@@ -33,13 +68,9 @@ void drwsurf_handle_frame_cb(void* data, struct wl_callback* callback,
     drwsurf_attach(ds);
 }
 
-const struct wl_callback_listener frame_listener = {
-    .done = drwsurf_handle_frame_cb
-};
-
 void drwsurf_register_frame_cb(struct drwsurf *ds)
 {
-    if (ds->frame_cb)
+    if (ds->frame_cb || ds->rendering)
         return;
     if (!ds->attached)
         return;
@@ -48,17 +79,30 @@ void drwsurf_register_frame_cb(struct drwsurf *ds)
     wl_surface_commit(ds->surf);
 }
 
+void drwsurf_request_render(struct drwsurf *ds)
+{
+    ds->render_pending = true;
+    drwsurf_register_frame_cb(ds);
+}
+
 void drwsurf_damage(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     cairo_rectangle_int_t rect = { x, y, w, h };
     cairo_region_union_rectangle(ds->damage, &rect);
-    cairo_region_union_rectangle(ds->backport_damage, &rect);
+    cairo_region_union_rectangle(ds->history[0], &rect);
     drwsurf_register_frame_cb(ds);
 }
 
 void
 drwsurf_resize(struct drwsurf *ds, uint32_t w, uint32_t h, double s)
 {
+    // headless, without a compositor: draw into plain memory instead
+    if (!ds->ctx || !ds->ctx->shm) {
+        drwsurf_resize_offscreen(ds, w, h, s);
+        return;
+    }
+    if (ds->scale != s)
+        drwsurf_flush_caches(ds);
     ds->scale = s;
     ds->width = ceil(w * s);
     ds->height = ceil(h * s);
@@ -66,48 +110,156 @@ drwsurf_resize(struct drwsurf *ds, uint32_t w, uint32_t h, double s)
     if (ds->damage)
         cairo_region_destroy(ds->damage);
     ds->damage = cairo_region_create();
-    if (ds->backport_damage)
-        cairo_region_destroy(ds->backport_damage);
-    ds->backport_damage = cairo_region_create();
+    for (int i = 0; i < DRW_DAMAGE_HISTORY; i++) {
+        if (ds->history[i])
+            cairo_region_destroy(ds->history[i]);
+        ds->history[i] = cairo_region_create();
+    }
 
     ds->released = true;
 
-    setup_buffer(ds, ds->back_buffer);
-    setup_buffer(ds, ds->display_buffer);
+    if (!ds->buffers_len) {
+        ds->buffers[ds->buffers_len++] = ds->back_buffer;
+        ds->buffers[ds->buffers_len++] = ds->display_buffer;
+    }
+    for (int i = 0; i < ds->buffers_len; i++)
+        setup_buffer(ds, ds->buffers[i]);
 }
 
+/* An offscreen surface is never attached: it draws with the same primitives
+ * into a plain image surface, to be blitted onto a real one with drw_blit. */
 void
-drwsurf_backport(struct drwsurf *ds)
+drwsurf_resize_offscreen(struct drwsurf *ds, uint32_t w, uint32_t h, double s)
+{
+    if (ds->scale != s)
+        drwsurf_flush_caches(ds);
+    ds->scale = s;
+    ds->width = ceil(w * s);
+    ds->height = ceil(h * s);
+
+    if (ds->damage)
+        cairo_region_destroy(ds->damage);
+    ds->damage = cairo_region_create();
+    if (!ds->history[0])
+        ds->history[0] = cairo_region_create();
+    ds->released = true;
+
+    struct drwbuf *d = ds->back_buffer;
+    ds->display_buffer = d;
+    if (d->cairo_surf)
+        cairo_surface_destroy(d->cairo_surf);
+    d->cairo_surf =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, ds->width, ds->height);
+    d->pool_data = cairo_image_surface_get_data(d->cairo_surf);
+    d->size = cairo_image_surface_get_stride(d->cairo_surf) * ds->height;
+
+    if (d->cairo)
+        cairo_destroy(d->cairo);
+    d->cairo = cairo_create(d->cairo_surf);
+    cairo_scale(d->cairo, ds->scale, ds->scale);
+    cairo_set_antialias(d->cairo, CAIRO_ANTIALIAS_NONE);
+    if (d->layout) {
+        pango_cairo_update_layout(d->cairo, d->layout);
+    } else {
+        d->layout = pango_cairo_create_layout(d->cairo);
+        pango_layout_set_auto_dir(d->layout, false);
+    }
+    cairo_save(d->cairo);
+}
+
+/* Bring a buffer up to date with the last attached one, copying only the
+ * damage of the frames it has missed since it was itself on screen. */
+static void
+drwsurf_repair(struct drwsurf *ds, struct drwbuf *db)
 {
-    cairo_save(ds->back_buffer->cairo);
+    struct drwbuf *src = ds->display_buffer;
+    if (db == src || db->age == 1)
+        return;
+
+    cairo_region_t *missed;
+    if (db->age == 0 || db->age > DRW_DAMAGE_HISTORY) {
+        cairo_rectangle_int_t all = {0, 0, ceil(ds->width / ds->scale),
+                                     ceil(ds->height / ds->scale)};
+        missed = cairo_region_create_rectangle(&all);
+    } else {
+        missed = cairo_region_create();
+        for (uint32_t i = 1; i < db->age; i++)
+            cairo_region_union(missed, ds->history[i]);
+    }
 
-    cairo_scale(ds->back_buffer->cairo, 1/ds->scale, 1/ds->scale);
-    cairo_set_operator(ds->back_buffer->cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_save(db->cairo);
+    cairo_scale(db->cairo, 1/ds->scale, 1/ds->scale);
+    cairo_set_operator(db->cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(db->cairo, src->cairo_surf, 0, 0);
 
     cairo_rectangle_int_t r = {0};
-    for (int i = 0; i < cairo_region_num_rectangles(ds->backport_damage); i++) {
-        cairo_region_get_rectangle(ds->backport_damage, i, &r);
-
-        cairo_set_source_surface(ds->back_buffer->cairo, ds->display_buffer->cairo_surf, 0, 0);
-        cairo_rectangle(
-            ds->back_buffer->cairo,
-            r.x * ds->scale,
-            r.y * ds->scale,
-            r.width * ds->scale,
-            r.height * ds->scale
-        );
-        cairo_fill(ds->back_buffer->cairo);
-    };
+    for (int i = 0; i < cairo_region_num_rectangles(missed); i++) {
+        cairo_region_get_rectangle(missed, i, &r);
+        cairo_rectangle(db->cairo, r.x * ds->scale, r.y * ds->scale,
+                        r.width * ds->scale, r.height * ds->scale);
+    }
+    cairo_fill(db->cairo);
+
+    cairo_restore(db->cairo);
+    cairo_region_destroy(missed);
+}
+
+/* the free buffer that has been off screen the shortest, growing the pool
+ * while the compositor holds on to all of them */
+static struct drwbuf *
+drwsurf_next_buffer(struct drwsurf *ds)
+{
+    struct drwbuf *best = NULL;
+    for (int i = 0; i < ds->buffers_len; i++) {
+        struct drwbuf *db = ds->buffers[i];
+        if (db->busy)
+            continue;
+        if (!best || (db->age && (!best->age || db->age < best->age)))
+            best = db;
+    }
+    if (best)
+        return best;
+
+    if (ds->buffers_len < DRW_MAX_BUFFERS) {
+        struct drwbuf *db = calloc(1, sizeof(*db));
+        if (db && setup_buffer(ds, db) == 0) {
+            ds->buffers[ds->buffers_len++] = db;
+            return db;
+        }
+        free(db);
+    }
 
-    cairo_restore(ds->back_buffer->cairo);
-    cairo_region_subtract(ds->backport_damage, ds->backport_damage);
+    // everything is held, reuse the oldest buffer that is not on screen
+    for (int i = 0; i < ds->buffers_len; i++) {
+        struct drwbuf *db = ds->buffers[i];
+        if (db == ds->display_buffer)
+            continue;
+        if (!best || !db->age || (best->age && db->age > best->age))
+            best = db;
+    }
+    return best ? best : ds->display_buffer;
 }
 
 void
 drwsurf_attach(struct drwsurf *ds)
 {
-    wl_surface_attach(ds->surf, ds->back_buffer->buf, 0, 0);
+    struct drwbuf *db = ds->back_buffer;
+    wl_surface_attach(ds->surf, db->buf, 0, 0);
     wl_surface_commit(ds->surf);
+
+    for (int i = 0; i < ds->buffers_len; i++) {
+        if (ds->buffers[i]->age)
+            ds->buffers[i]->age++;
+    }
+    db->age = 1;
+    db->busy = true;
+    ds->display_buffer = db;
+
+    cairo_region_destroy(ds->history[DRW_DAMAGE_HISTORY - 1]);
+    memmove(&ds->history[1], &ds->history[0],
+            (DRW_DAMAGE_HISTORY - 1) * sizeof(ds->history[0]));
+    ds->history[0] = cairo_region_create();
+
     ds->released = false;
     ds->attached = true;
 }
@@ -118,11 +270,140 @@ drwsurf_flip(struct drwsurf *ds)
     if (ds->released)
         return;
     ds->released = true;
-    struct drwbuf *tmp = ds->back_buffer;
-    ds->back_buffer = ds->display_buffer;
-    ds->display_buffer = tmp;
+    ds->back_buffer = drwsurf_next_buffer(ds);
+    drwsurf_repair(ds, ds->back_buffer);
+}
+
+static uint32_t
+drw_text_hash(Color color, uint32_t w, uint32_t h, uint32_t b,
+              const char *label, PangoFontDescription *font_description)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)label; *p; p++)
+        hash = (hash ^ *p) * 16777619u;
+    hash = (hash ^ (uint32_t)(uintptr_t)font_description) * 16777619u;
+    hash = (hash ^ color.color) * 16777619u;
+    hash = (hash ^ w) * 16777619u;
+    hash = (hash ^ h) * 16777619u;
+    hash = (hash ^ b) * 16777619u;
+    return hash;
+}
+
+static void
+drwtext_render(struct drwsurf *ds, struct drwtext *t)
+{
+    int sw = ceil(t->w * ds->scale), sh = ceil(t->h * ds->scale);
+    t->surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, sw, sh);
+
+    cairo_t *cairo = cairo_create(t->surf);
+    cairo_scale(cairo, ds->scale, ds->scale);
+    cairo_set_antialias(cairo, CAIRO_ANTIALIAS_NONE);
+    if (!ds->text_layout) {
+        ds->text_layout = pango_cairo_create_layout(cairo);
+        pango_layout_set_auto_dir(ds->text_layout, false);
+    } else {
+        pango_cairo_update_layout(cairo, ds->text_layout);
+    }
+    PangoLayout *layout = ds->text_layout;
+
+    pango_layout_set_font_description(layout, t->font_description);
+
+    cairo_set_source_rgba(
+        cairo, t->color.bgra[2] / (double)255, t->color.bgra[1] / (double)255,
+        t->color.bgra[0] / (double)255, t->color.bgra[3] / (double)255);
+    cairo_move_to(cairo, t->w / 2, t->h / 2);
+
+    pango_layout_set_text(layout, t->label, -1);
+    pango_layout_set_width(layout, (t->w - (t->b * 2)) * PANGO_SCALE);
+    pango_layout_set_height(layout, (t->h - (t->b * 2)) * PANGO_SCALE);
+
+    int width, height;
+    pango_layout_get_pixel_size(layout, &width, &height);
+
+    cairo_rel_move_to(cairo, -width / 2, -height / 2);
+
+    pango_cairo_show_layout(cairo, layout);
+    cairo_destroy(cairo);
+    cairo_surface_flush(t->surf);
+}
+
+static void
+drwtext_release(struct drwtext *t)
+{
+    free(t->label);
+    t->label = NULL;
+    if (t->surf)
+        cairo_surface_destroy(t->surf);
+    t->surf = NULL;
+}
+
+/* Find the pre-rendered label, rendering it into the least recently used
+ * slot of its probe sequence if it is not cached yet */
+static struct drwtext *
+drwsurf_text(struct drwsurf *ds, Color color, uint32_t w, uint32_t h,
+             uint32_t b, const char *label,
+             PangoFontDescription *font_description)
+{
+    if (!ds->text_cache) {
+        ds->text_cache = calloc(DRW_TEXT_CACHE_SIZE, sizeof(struct drwtext));
+        if (!ds->text_cache)
+            return NULL;
+    }
+
+    uint32_t hash = drw_text_hash(color, w, h, b, label, font_description);
+    struct drwtext *victim = NULL;
+    for (int i = 0; i < DRW_TEXT_CACHE_PROBE; i++) {
+        struct drwtext *t =
+            &ds->text_cache[(hash + i) % DRW_TEXT_CACHE_SIZE];
+        if (t->label && t->hash == hash && t->w == w && t->h == h &&
+            t->b == b && t->color.color == color.color &&
+            t->font_description == font_description &&
+            strcmp(t->label, label) == 0) {
+            t->last_used = ++ds->text_clock;
+            return t;
+        }
+        if (!victim || (victim->label && (!t->label ||
+                                          t->last_used < victim->last_used)))
+            victim = t;
+    }
+
+    drwtext_release(victim);
+    victim->label = strdup(label);
+    if (!victim->label)
+        return NULL;
+    victim->font_description = font_description;
+    victim->color = color;
+    victim->w = w;
+    victim->h = h;
+    victim->b = b;
+    victim->hash = hash;
+    victim->last_used = ++ds->text_clock;
+    drwtext_render(ds, victim);
+    return victim;
+}
 
-    drwsurf_backport(ds);
+void
+drwsurf_flush_caches(struct drwsurf *ds)
+{
+    for (int i = 0; i < DRW_SHAPE_CACHE_SIZE; i++) {
+        if (ds->shape_cache[i].mask)
+            cairo_surface_destroy(ds->shape_cache[i].mask);
+        ds->shape_cache[i].mask = NULL;
+    }
+    if (!ds->text_cache)
+        return;
+    for (int i = 0; i < DRW_TEXT_CACHE_SIZE; i++)
+        drwtext_release(&ds->text_cache[i]);
+}
+
+void
+drw_cache_text(struct drwsurf *ds, Color color, uint32_t w, uint32_t h,
+               uint32_t b, const char *label,
+               PangoFontDescription *font_description)
+{
+    if (!label || !w || !h)
+        return;
+    drwsurf_text(ds, color, w, h, b, label, font_description);
 }
 
 void
@@ -130,29 +411,28 @@ drw_draw_text(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
               uint32_t w, uint32_t h, uint32_t b, const char *label,
               PangoFontDescription *font_description)
 {
+    if (!label || !w || !h)
+        return;
+    struct drwtext *t = drwsurf_text(ds, color, w, h, b, label,
+                                     font_description);
+    if (!t)
+        return;
+
     drwsurf_flip(ds);
     struct drwbuf *d = ds->back_buffer;
     drwsurf_damage(ds, x, y, w, h);
 
     cairo_save(d->cairo);
 
-    pango_layout_set_font_description(d->layout, font_description);
-
-    cairo_set_source_rgba(
-        d->cairo, color.bgra[2] / (double)255, color.bgra[1] / (double)255,
-        color.bgra[0] / (double)255, color.bgra[3] / (double)255);
-    cairo_move_to(d->cairo, x + w / 2, y + h / 2);
-
-    pango_layout_set_text(d->layout, label, -1);
-    pango_layout_set_width(d->layout, (w - (b * 2)) * PANGO_SCALE);
-    pango_layout_set_height(d->layout, (h - (b * 2)) * PANGO_SCALE);
-
-    int width, height;
-    pango_layout_get_pixel_size(d->layout, &width, &height);
-
-    cairo_rel_move_to(d->cairo, -width / 2, -height / 2);
+    // blit in device pixels so the label is not resampled
+    double sx = round(x * ds->scale), sy = round(y * ds->scale);
+    cairo_scale(d->cairo, 1 / ds->scale, 1 / ds->scale);
+    cairo_set_operator(d->cairo, CAIRO_OPERATOR_OVER);
+    cairo_set_source_surface(d->cairo, t->surf, sx, sy);
+    cairo_rectangle(d->cairo, sx, sy, cairo_image_surface_get_width(t->surf),
+                    cairo_image_surface_get_height(t->surf));
+    cairo_fill(d->cairo);
 
-    pango_cairo_show_layout(d->cairo, d->layout);
     cairo_restore(d->cairo);
 }
 
@@ -194,17 +474,30 @@ drw_over_polyline(struct drwsurf *ds, Color color, double width_px,
     cairo_set_line_cap(d->cairo, CAIRO_LINE_CAP_ROUND);
     cairo_set_line_join(d->cairo, CAIRO_LINE_JOIN_ROUND);
 
-    for (size_t i = 1; i < n; i++) {
+    // Consecutive segments whose alpha falls in the same bucket are joined
+    // into one path and stroked once, so a trail costs a handful of strokes.
+    size_t start = 1;
+    while (start < n) {
+        uint8_t bucket = alphas ? alphas[start] >> DRW_TRAIL_ALPHA_SHIFT : 0;
+        size_t end = start + 1;
+        while (end < n && alphas &&
+               (alphas[end] >> DRW_TRAIL_ALPHA_SHIFT) == bucket)
+            end++;
+
         double alpha = color.bgra[3] / (double)255;
         if (alphas) {
-            alpha *= alphas[i] / (double)255;
+            alpha *= alphas[end - 1] / (double)255;
+        }
+        if (alpha > 0) {
+            cairo_set_source_rgba(d->cairo, color.bgra[2] / (double)255,
+                                  color.bgra[1] / (double)255,
+                                  color.bgra[0] / (double)255, alpha);
+            cairo_move_to(d->cairo, xs[start - 1], ys[start - 1]);
+            for (size_t i = start; i < end; i++)
+                cairo_line_to(d->cairo, xs[i], ys[i]);
+            cairo_stroke(d->cairo);
         }
-        cairo_set_source_rgba(d->cairo, color.bgra[2] / (double)255,
-                              color.bgra[1] / (double)255,
-                              color.bgra[0] / (double)255, alpha);
-        cairo_move_to(d->cairo, xs[i - 1], ys[i - 1]);
-        cairo_line_to(d->cairo, xs[i], ys[i]);
-        cairo_stroke(d->cairo);
+        start = end;
     }
 
     cairo_restore(d->cairo);
@@ -235,8 +528,47 @@ drw_measure_text(struct drwsurf *ds, const char *label,
         *out_h = h;
 }
 
+/* Copy a region of what has been drawn so far into a new image surface */
+cairo_surface_t *
+drw_save_region(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t w,
+                uint32_t h)
+{
+    cairo_surface_t *saved = cairo_image_surface_create(
+        CAIRO_FORMAT_ARGB32, ceil(w * ds->scale), ceil(h * ds->scale));
+    cairo_t *cairo = cairo_create(saved);
+    cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(cairo, ds->back_buffer->cairo_surf,
+                             -round(x * ds->scale), -round(y * ds->scale));
+    cairo_paint(cairo);
+    cairo_destroy(cairo);
+    return saved;
+}
+
 void
-drw_do_clear(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+drw_restore_region(struct drwsurf *ds, cairo_surface_t *saved, uint32_t x,
+                   uint32_t y, uint32_t w, uint32_t h)
+{
+    drwsurf_flip(ds);
+    struct drwbuf *d = ds->back_buffer;
+    drwsurf_damage(ds, x, y, w, h);
+
+    cairo_save(d->cairo);
+
+    double sx = round(x * ds->scale), sy = round(y * ds->scale);
+    cairo_scale(d->cairo, 1 / ds->scale, 1 / ds->scale);
+    cairo_set_operator(d->cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(d->cairo, saved, sx, sy);
+    cairo_rectangle(d->cairo, sx, sy, cairo_image_surface_get_width(saved),
+                    cairo_image_surface_get_height(saved));
+    cairo_fill(d->cairo);
+
+    cairo_restore(d->cairo);
+}
+
+/* copy a w x h area at src_x, src_y of an offscreen surface to x, y */
+void
+drw_blit(struct drwsurf *ds, struct drwsurf *src, uint32_t src_x,
+         uint32_t src_y, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     drwsurf_flip(ds);
     struct drwbuf *d = ds->back_buffer;
@@ -244,13 +576,115 @@ drw_do_clear(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 
     cairo_save(d->cairo);
 
-    cairo_set_operator(d->cairo, CAIRO_OPERATOR_CLEAR);
-    cairo_rectangle(d->cairo, x, y, w, h);
+    double sx = round(x * ds->scale), sy = round(y * ds->scale);
+    cairo_scale(d->cairo, 1 / ds->scale, 1 / ds->scale);
+    cairo_set_operator(d->cairo, CAIRO_OPERATOR_SOURCE);
+    cairo_set_source_surface(d->cairo, src->back_buffer->cairo_surf,
+                             sx - round(src_x * src->scale),
+                             sy - round(src_y * src->scale));
+    cairo_rectangle(d->cairo, sx, sy, round((x + w) * ds->scale) - sx,
+                    round((y + h) * ds->scale) - sy);
     cairo_fill(d->cairo);
 
     cairo_restore(d->cairo);
 }
 
+/* Write a premultiplied pixel over a rectangle given in surface
+ * coordinates, straight into the buffer memory. Pixel edges land where the
+ * non-antialiased cairo path would put them. */
+void
+drwbuf_fill_pixels(struct drwsurf *ds, struct drwbuf *d, uint32_t x,
+                   uint32_t y, uint32_t w, uint32_t h, uint32_t pixel)
+{
+    int x0 = round(x * ds->scale), y0 = round(y * ds->scale);
+    int x1 = round((x + w) * ds->scale), y1 = round((y + h) * ds->scale);
+    if (x1 > (int)ds->width)
+        x1 = ds->width;
+    if (y1 > (int)ds->height)
+        y1 = ds->height;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    cairo_surface_flush(d->cairo_surf);
+    pixman_fill((uint32_t *)d->pool_data, ds->width, 32, x0, y0, x1 - x0,
+                y1 - y0, pixel);
+    cairo_surface_mark_dirty_rectangle(d->cairo_surf, x0, y0, x1 - x0,
+                                       y1 - y0);
+}
+
+uint32_t
+drw_premultiply(Color color)
+{
+    uint32_t a = color.bgra[3];
+    uint32_t r = (color.bgra[2] * a + 127) / 255;
+    uint32_t g = (color.bgra[1] * a + 127) / 255;
+    uint32_t b = (color.bgra[0] * a + 127) / 255;
+    return a << 24 | r << 16 | g << 8 | b;
+}
+
+void
+drw_do_clear(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    drwsurf_flip(ds);
+    struct drwbuf *d = ds->back_buffer;
+    drwsurf_damage(ds, x, y, w, h);
+
+    drwbuf_fill_pixels(ds, d, x, y, w, h, 0);
+}
+
+/* Find the mask for a rounded rectangle of the given size, rendering it into
+ * the least recently used slot if it is not cached yet */
+static struct drwshape *
+drwsurf_shape(struct drwsurf *ds, uint32_t w, uint32_t h, int rounding)
+{
+    struct drwshape *victim = &ds->shape_cache[0];
+    for (int i = 0; i < DRW_SHAPE_CACHE_SIZE; i++) {
+        struct drwshape *sh = &ds->shape_cache[i];
+        if (sh->mask && sh->w == w && sh->h == h && sh->rounding == rounding) {
+            sh->last_used = ++ds->shape_clock;
+            return sh;
+        }
+        if (victim->mask && (!sh->mask || sh->last_used < victim->last_used))
+            victim = sh;
+    }
+
+    if (victim->mask)
+        cairo_surface_destroy(victim->mask);
+    victim->w = w;
+    victim->h = h;
+    victim->rounding = rounding;
+    victim->last_used = ++ds->shape_clock;
+    victim->mask = cairo_image_surface_create(
+        CAIRO_FORMAT_A8, ceil(w * ds->scale), ceil(h * ds->scale));
+
+    cairo_t *cairo = cairo_create(victim->mask);
+    cairo_scale(cairo, ds->scale, ds->scale);
+    cairo_set_antialias(cairo, CAIRO_ANTIALIAS_NONE);
+
+    double radius = rounding / 1.0;
+    double degrees = M_PI / 180.0;
+
+    cairo_new_sub_path (cairo);
+    cairo_arc (cairo, w - radius, radius, radius, -90 * degrees, 0 * degrees);
+    cairo_arc (cairo, w - radius, h - radius, radius, 0 * degrees, 90 * degrees);
+    cairo_arc (cairo, radius, h - radius, radius, 90 * degrees, 180 * degrees);
+    cairo_arc (cairo, radius, radius, radius, 180 * degrees, 270 * degrees);
+    cairo_close_path (cairo);
+
+    cairo_set_source_rgba(cairo, 0, 0, 0, 1);
+    cairo_fill(cairo);
+    cairo_destroy(cairo);
+    cairo_surface_flush(victim->mask);
+    return victim;
+}
+
+void
+drw_cache_rectangle(struct drwsurf *ds, uint32_t w, uint32_t h, int rounding)
+{
+    if (rounding > 0 && w && h)
+        drwsurf_shape(ds, w, h, rounding);
+}
+
 void
 drw_do_rectangle(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
                  uint32_t w, uint32_t h, bool over, int rounding)
@@ -259,6 +693,12 @@ drw_do_rectangle(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
     struct drwbuf *d = ds->back_buffer;
     drwsurf_damage(ds, x, y, w, h);
 
+    if (rounding <= 0 && (!over || color.bgra[3] == 255)) {
+        // a solid, square fill replaces the pixels whatever the operator
+        drwbuf_fill_pixels(ds, d, x, y, w, h, drw_premultiply(color));
+        return;
+    }
+
     cairo_save(d->cairo);
 
     if (over) {
@@ -267,36 +707,22 @@ drw_do_rectangle(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
         cairo_set_operator(d->cairo, CAIRO_OPERATOR_SOURCE);
     }
 
-    if (rounding > 0) {
-        double radius = rounding / 1.0;
-        double degrees = M_PI / 180.0;
-
-        cairo_new_sub_path (d->cairo);
-        cairo_arc (d->cairo, x + w - radius, y + radius, radius, -90 * degrees, 0 * degrees);
-        cairo_arc (d->cairo, x + w - radius, y + h - radius, radius, 0 * degrees, 90 * degrees);
-        cairo_arc (d->cairo, x + radius, y + h - radius, radius, 90 * degrees, 180 * degrees);
-        cairo_arc (d->cairo, x + radius, y + radius, radius, 180 * degrees, 270 * degrees);
-        cairo_close_path (d->cairo);
-
-        cairo_set_source_rgba(
-          d->cairo, color.bgra[2] / (double)255, color.bgra[1] / (double)255, 
-          color.bgra[0] / (double)255, color.bgra[3] / (double)255);
-        cairo_fill (d->cairo);
-        cairo_set_source_rgba(d->cairo, 0, 0, 0, 0.9);
-        cairo_set_line_width(d->cairo, 1.0);
-        cairo_stroke(d->cairo);
-
-        cairo_restore(d->cairo);
-    }
-    else {
+    cairo_set_source_rgba(
+        d->cairo, color.bgra[2] / (double)255, color.bgra[1] / (double)255,
+        color.bgra[0] / (double)255, color.bgra[3] / (double)255);
+
+    if (rounding > 0 && w && h) {
+        // composite the cached shape tinted with the colour, in device pixels
+        struct drwshape *sh = drwsurf_shape(ds, w, h, rounding);
+        cairo_scale(d->cairo, 1 / ds->scale, 1 / ds->scale);
+        cairo_mask_surface(d->cairo, sh->mask, round(x * ds->scale),
+                           round(y * ds->scale));
+    } else {
         cairo_rectangle(d->cairo, x, y, w, h);
-        cairo_set_source_rgba(
-            d->cairo, color.bgra[2] / (double)255, color.bgra[1] / (double)255,
-            color.bgra[0] / (double)255, color.bgra[3] / (double)255);
         cairo_fill(d->cairo);
-
-        cairo_restore(d->cairo);
     }
+
+    cairo_restore(d->cairo);
 }
 
 void
@@ -313,38 +739,71 @@ drw_over_rectangle(struct drwsurf *d, Color color, uint32_t x, uint32_t y,
     drw_do_rectangle(d, color, x, y, w, h, true, rounding);
 }
 
+/* Make room in the surface's pool for DRW_MAX_BUFFERS buffers of buf_size
+ * bytes. Pages are only backed once drawn to, so reserving slots is free. */
+static int
+drwsurf_reserve_pool(struct drwsurf *ds, size_t buf_size)
+{
+    size_t size = buf_size * DRW_MAX_BUFFERS;
+    if (ds->pool && size <= ds->pool_size)
+        return 0;
+
+    int fd = ds->pool ? ds->pool_fd : allocate_shm_file(size);
+    if (fd == -1)
+        return -1;
+    if (ds->pool) {
+        int ret;
+        do {
+            ret = ftruncate(fd, size);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0)
+            return -1;
+    }
+
+    unsigned char *data = map_shm_file(fd, size);
+    if (data == MAP_FAILED) {
+        if (!ds->pool)
+            close(fd);
+        return -1;
+    }
+    if (ds->pool_data)
+        unmap_shm_file(ds->pool_data, ds->pool_size);
+    ds->pool_data = data;
+
+    if (ds->pool) {
+        wl_shm_pool_resize(ds->pool, size);
+    } else {
+        ds->pool = wl_shm_create_pool(ds->ctx->shm, fd, size);
+        ds->pool_fd = fd;
+    }
+    ds->pool_size = size;
+    return 0;
+}
+
 uint32_t
 setup_buffer(struct drwsurf *drwsurf, struct drwbuf *drwbuf)
 {
-    int prev_size = drwbuf->size;
     int stride = drwsurf->width * 4;
     drwbuf->size = stride * drwsurf->height;
 
-    int fd = allocate_shm_file(drwbuf->size);
-    if (fd == -1) {
+    // each buffer owns a fixed slot of the pool, in pool order
+    int slot = 0;
+    while (slot < drwsurf->buffers_len && drwsurf->buffers[slot] != drwbuf)
+        slot++;
+    if (slot >= DRW_MAX_BUFFERS || !drwbuf->size)
         return 1;
-    }
-
-    if (drwbuf->pool_data)
-        munmap(drwbuf->pool_data, prev_size);
-    drwbuf->pool_data =
-        mmap(NULL, drwbuf->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (drwbuf->pool_data == MAP_FAILED) {
-        close(fd);
+    if (drwsurf_reserve_pool(drwsurf, drwbuf->size))
         return 1;
-    }
+    drwbuf->pool_data = drwsurf->pool_data + (size_t)slot * drwbuf->size;
 
     if (drwbuf->buf)
         wl_buffer_destroy(drwbuf->buf);
-    struct wl_shm_pool *pool =
-        wl_shm_create_pool(drwsurf->ctx->shm, fd, drwbuf->size);
-    drwbuf->buf =
-        wl_shm_pool_create_buffer(pool, 0, drwsurf->width, drwsurf->height,
-                                  stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
-    close(fd);
-    wl_buffer_add_listener(drwbuf->buf, &buffer_listener, drwsurf);
-
+    drwbuf->buf = wl_shm_pool_create_buffer(
+        drwsurf->pool, slot * drwbuf->size, drwsurf->width, drwsurf->height,
+        stride, WL_SHM_FORMAT_ARGB8888);
+    wl_buffer_add_listener(drwbuf->buf, &buffer_listener, drwbuf);
+    drwbuf->busy = false;
+    drwbuf->age = 0;
 
     if (drwbuf->cairo_surf)
         cairo_surface_destroy(drwbuf->cairo_surf);
@@ -357,8 +816,12 @@ setup_buffer(struct drwsurf *drwsurf, struct drwbuf *drwbuf)
     drwbuf->cairo = cairo_create(drwbuf->cairo_surf);
     cairo_scale(drwbuf->cairo, drwsurf->scale, drwsurf->scale);
     cairo_set_antialias(drwbuf->cairo, CAIRO_ANTIALIAS_NONE);
-    drwbuf->layout = pango_cairo_create_layout(drwbuf->cairo);
-    pango_layout_set_auto_dir(drwbuf->layout, false);
+    if (drwbuf->layout) {
+        pango_cairo_update_layout(drwbuf->cairo, drwbuf->layout);
+    } else {
+        drwbuf->layout = pango_cairo_create_layout(drwbuf->cairo);
+        pango_layout_set_auto_dir(drwbuf->layout, false);
+    }
     cairo_save(drwbuf->cairo);
 
     return 0;
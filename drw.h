@@ -4,9 +4,39 @@
 #include <pango/pangocairo.h>
 #include <stdbool.h>
 
+typedef union {
+	uint8_t bgra[4];
+	uint32_t color;
+} Color;
+
+#define DRW_TEXT_CACHE_SIZE 256
+#define DRW_TEXT_CACHE_PROBE 8
+#define DRW_SHAPE_CACHE_SIZE 64
+#define DRW_MAX_BUFFERS 3
+#define DRW_DAMAGE_HISTORY 4
+/* trail segments are batched by alpha >> DRW_TRAIL_ALPHA_SHIFT */
+#define DRW_TRAIL_ALPHA_SHIFT 3
+
 struct drw {
 	struct wl_shm *shm;
 };
+/* a label rendered once at the surface scale, ready to be blitted */
+struct drwtext {
+	char *label;
+	PangoFontDescription *font_description;
+	Color color;
+	uint32_t w, h, b;
+	uint32_t hash;
+	uint32_t last_used;
+	cairo_surface_t *surf;
+};
+/* coverage mask of a rounded rectangle, tinted when it is composited */
+struct drwshape {
+	uint32_t w, h;
+	int rounding;
+	uint32_t last_used;
+	cairo_surface_t *mask;
+};
 struct drwbuf {
 	uint32_t size;
 	struct wl_buffer *buf;
@@ -14,6 +44,9 @@ struct drwbuf {
 	cairo_t *cairo;
 	PangoLayout *layout;
 	unsigned char *pool_data;
+
+	bool busy;    /* attached and not yet released by the compositor */
+	uint32_t age; /* frames since it was last attached, 0 if undefined */
 };
 struct drwsurf {
 	uint32_t width, height;
@@ -24,22 +57,45 @@ struct drwsurf {
 	struct wl_shm *shm;
 	struct wl_callback *frame_cb;
 
-	cairo_region_t *damage, *backport_damage;
+	cairo_region_t *damage;
+	/* damage of the frame being drawn, then of each frame attached before */
+	cairo_region_t *history[DRW_DAMAGE_HISTORY];
 	bool attached;
 	bool released;
 
+	/* called at the start of each frame once drwsurf_request_render()
+	 * was, to paint whatever changed since the last one */
+	void (*render)(void *data);
+	void *render_data;
+	bool render_pending;
+	bool rendering;
+
 	struct drwbuf *back_buffer;
 	struct drwbuf *display_buffer;
+	struct drwbuf *buffers[DRW_MAX_BUFFERS];
+	int buffers_len;
+
+	/* one pool for all buffers, only ever grown */
+	struct wl_shm_pool *pool;
+	int pool_fd;
+	unsigned char *pool_data;
+	size_t pool_size;
+
+	struct drwtext *text_cache;
+	PangoLayout *text_layout;
+	uint32_t text_clock;
+
+	struct drwshape shape_cache[DRW_SHAPE_CACHE_SIZE];
+	uint32_t shape_clock;
 };
 struct kbd;
 
 void drwsurf_resize(struct drwsurf *ds, uint32_t w, uint32_t h, double s);
+void drwsurf_resize_offscreen(struct drwsurf *ds, uint32_t w, uint32_t h,
+                              double s);
 void drwsurf_attach(struct drwsurf *ds);
-
-typedef union {
-	uint8_t bgra[4];
-	uint32_t color;
-} Color;
+void drwsurf_request_render(struct drwsurf *ds);
+void drwsurf_present(struct drwsurf *ds);
 
 void drw_do_clear(struct drwsurf *ds, uint32_t x, uint32_t y,
                       uint32_t w, uint32_t h);
@@ -49,6 +105,9 @@ void drw_fill_rectangle(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
                         uint32_t w, uint32_t h, int rounding);
 void drw_over_rectangle(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
                         uint32_t w, uint32_t h, int rounding);
+void drwbuf_fill_pixels(struct drwsurf *ds, struct drwbuf *d, uint32_t x,
+                        uint32_t y, uint32_t w, uint32_t h, uint32_t pixel);
+uint32_t drw_premultiply(Color color);
 
 void drw_draw_text(struct drwsurf *ds, Color color, uint32_t x, uint32_t y,
                    uint32_t w, uint32_t h, uint32_t b, const char *label,
@@ -58,6 +117,20 @@ void drw_over_polyline(struct drwsurf *ds, Color color, double width_px,
                        const double *xs, const double *ys,
                        const uint8_t *alphas, size_t n);
 
+void drw_cache_text(struct drwsurf *ds, Color color, uint32_t w, uint32_t h,
+                    uint32_t b, const char *label,
+                    PangoFontDescription *font_description);
+void drwsurf_flush_caches(struct drwsurf *ds);
+void drw_cache_rectangle(struct drwsurf *ds, uint32_t w, uint32_t h,
+                         int rounding);
+
+cairo_surface_t *drw_save_region(struct drwsurf *ds, uint32_t x, uint32_t y,
+                                 uint32_t w, uint32_t h);
+void drw_restore_region(struct drwsurf *ds, cairo_surface_t *saved,
+                        uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+void drw_blit(struct drwsurf *ds, struct drwsurf *src, uint32_t src_x,
+              uint32_t src_y, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+
 void drw_measure_text(struct drwsurf *ds, const char *label,
                       PangoFontDescription *font_description, int *out_w,
                       int *out_h);
@@ -7,6 +7,10 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-client-protocol.h>
 #include "keyboard.h"
 #include "drw.h"
@@ -25,6 +29,115 @@
 #endif
 #include KEYMAP
 
+static void kbd_render(void *data);
+static bool kbd_suggest_flinging(struct kbd *kb);
+static void kbd_suggest_fling_step(struct kbd *kb, uint64_t now_ms);
+
+/* Everything sent to the compositor goes through these, so that a recorder
+ * can stand in for the virtual keyboard when running headless */
+static void
+kbd_send_key(struct kbd *kb, uint32_t time, uint32_t key, uint32_t state)
+{
+    if (kb->recorder) {
+        kb->recorder->keys++;
+        if (kb->recorder->log)
+            fprintf(kb->recorder->log, "key %u %u %s\n", time, key,
+                    state == WL_KEYBOARD_KEY_STATE_PRESSED ? "pressed"
+                                                           : "released");
+        return;
+    }
+    zwp_virtual_keyboard_v1_key(kb->vkbd, time, key, state);
+}
+
+static void
+kbd_send_modifiers(struct kbd *kb, uint32_t mods)
+{
+    if (kb->recorder) {
+        kb->recorder->modifiers++;
+        if (kb->recorder->log)
+            fprintf(kb->recorder->log, "modifiers 0x%x\n", mods);
+        return;
+    }
+    zwp_virtual_keyboard_v1_modifiers(kb->vkbd, mods, 0, 0, 0);
+}
+
+static void
+kbd_send_keymap(struct kbd *kb, int fd, uint32_t size)
+{
+    if (kb->recorder) {
+        kb->recorder->keymaps++;
+        if (kb->recorder->log)
+            fprintf(kb->recorder->log, "keymap %u bytes\n", size);
+        return;
+    }
+    zwp_virtual_keyboard_v1_keymap(kb->vkbd, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+                                   fd, size);
+}
+
+static struct kbd_contact *
+kbd_contact_find(struct kbd *kb, int32_t id)
+{
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        if (kb->contacts[i].down && kb->contacts[i].id == id) {
+            return &kb->contacts[i];
+        }
+    }
+    return NULL;
+}
+
+static struct kbd_contact *
+kbd_contact_in_mode(struct kbd *kb, enum kbd_input_mode mode)
+{
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        if (kb->contacts[i].down && kb->contacts[i].mode == mode) {
+            return &kb->contacts[i];
+        }
+    }
+    return NULL;
+}
+
+static int
+kbd_contacts_down(struct kbd *kb)
+{
+    int n = 0;
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        if (kb->contacts[i].down) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* the earliest held tap that went down before seq, if any */
+static struct kbd_contact *
+kbd_oldest_tap(struct kbd *kb, uint32_t seq)
+{
+    struct kbd_contact *oldest = NULL;
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        struct kbd_contact *c = &kb->contacts[i];
+        if (c->down && c->mode == KBD_INPUT_TAP && c->seq < seq &&
+            (!oldest || c->seq < oldest->seq)) {
+            oldest = c;
+        }
+    }
+    return oldest;
+}
+
+/* the last finger to land among held taps, the one the preview follows */
+static struct kbd_contact *
+kbd_newest_tap(struct kbd *kb)
+{
+    struct kbd_contact *newest = NULL;
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        struct kbd_contact *c = &kb->contacts[i];
+        if (c->down && c->mode == KBD_INPUT_TAP &&
+            (!newest || c->seq > newest->seq)) {
+            newest = c;
+        }
+    }
+    return newest;
+}
+
 void
 kbd_switch_layout(struct kbd *kb, struct layout *l, size_t layer_index)
 {
@@ -45,7 +158,7 @@ kbd_switch_layout(struct kbd *kb, struct layout *l, size_t layer_index)
         fprintf(stderr, "Switching to keymap %s\n", kb->layout->keymap_name);
         create_and_upload_keymap(kb, kb->layout->keymap_name, 0, 0);
     }
-    kbd_draw_layout(kb);
+    kbd_schedule_layout(kb);
 }
 
 void
@@ -209,6 +322,14 @@ kbd_init(struct kbd *kb, struct layout *layouts, char *layer_names_list,
     kb->suggest_mode = WVKBD_SMODE_NONE;
     kb->suggest_scroll_x = 0;
     kb->suggest_content_width = 0;
+    kb->suggest_strip.back_buffer = &kb->suggest_strip_buf;
+    kb->dirty_layout = false;
+    kb->surf->render = kbd_render;
+    kb->surf->render_data = kb;
+    kb->suggest_strip_valid = false;
+    kb->suggest_fling_v = 0;
+    kb->trail_dirty = false;
+    kb->frame_ms = 16;
     kb->suggest_cancel_visible = false;
     kb->suggest_cancel_x = kb->suggest_cancel_y = 0;
     kb->suggest_cancel_w = kb->suggest_cancel_h = 0;
@@ -225,13 +346,21 @@ kbd_init(struct kbd *kb, struct layout *layouts, char *layer_names_list,
         kb->context_words_max = 5;
     }
 
-    kb->input_down = false;
-    kb->input_mode = KBD_INPUT_NONE;
+    for (i = 0; i < KBD_MAX_CONTACTS; i++) {
+        kb->contacts[i].down = false;
+        kb->contacts[i].mode = KBD_INPUT_NONE;
+    }
+    kb->contact_seq = 0;
     kb->preview_key = NULL;
 
     kb->swipe_threshold_px = 18;
     kb->swipe_points_len = 0;
     kb->swipe_last_suggest_time = 0;
+    if (kb->swipe_budget <= 0 || kb->swipe_budget > 100) {
+        kb->swipe_budget = 50;
+    }
+    kb->swipe_cost_ms = 0.0;
+    kb->swipe_interval_ms = 40;
     kb->pending_swipe = false;
     kb->pending_swipe_word[0] = '\0';
     kb->dismissed_words_len = 0;
@@ -257,8 +386,18 @@ kbd_init_layout(struct layout *l, uint32_t width, uint32_t height,
     uint8_t rows = kbd_get_rows(l);
 
     l->keyheight = height / rows;
+    l->y_offset = y_offset;
+    if (!l->rows) {
+        l->rows = malloc(rows * sizeof(struct key *));
+        if (!l->rows) {
+            die("could not allocate layout rows\n");
+        }
+    }
+    l->rows_len = rows;
+    l->rows[0] = l->keys;
 
     struct key *k = l->keys;
+    uint8_t row = 0;
     double rowlength = kbd_get_row_length(k);
     double rowwidth = 0.0;
     while (k->type != Last) {
@@ -267,6 +406,7 @@ kbd_init_layout(struct layout *l, uint32_t width, uint32_t height,
             x = 0;
             rowwidth = 0.0;
             rowlength = kbd_get_row_length(k + 1);
+            l->rows[++row] = k + 1;
         } else if (k->width > 0) {
             k->x = x;
             k->y = y;
@@ -298,13 +438,20 @@ struct key *
 kbd_get_key(struct kbd *kb, uint32_t x, uint32_t y)
 {
     struct layout *l = kb->layout;
-    struct key *k = l->keys;
     if (kb->debug)
         fprintf(stderr, "get key: +%d+%d\n", x, y);
-    while (k->type != Last) {
-        if ((k->type != EndRow) && (k->type != Pad) && (k->type != Pad) &&
-            (x >= k->x) && (y >= k->y) && (x < k->x + k->w) &&
-            (y < k->y + k->h)) {
+    if (!l->rows || !l->keyheight || y < l->y_offset) {
+        return NULL;
+    }
+    // rows all share the same height, so only one of them needs scanning
+    uint32_t row = (y - l->y_offset) / l->keyheight;
+    if (row >= l->rows_len) {
+        return NULL;
+    }
+    struct key *k = l->rows[row];
+    while ((k->type != Last) && (k->type != EndRow)) {
+        if ((k->type != Pad) && (x >= k->x) && (y >= k->y) &&
+            (x < k->x + k->w) && (y < k->y + k->h)) {
             return k;
         }
         k++;
@@ -312,6 +459,68 @@ kbd_get_key(struct kbd *kb, uint32_t x, uint32_t y)
     return NULL;
 }
 
+/* Keys of a row overlapping the span from xa to xb, in the order a finger
+ * moving from xa to xb crosses them */
+static int
+kbd_row_keys(struct key *k, double xa, double xb, struct key **out, int max)
+{
+    double lo = fmin(xa, xb), hi = fmax(xa, xb);
+    int n = 0;
+    for (; (k->type != Last) && (k->type != EndRow) && n < max; k++) {
+        if ((k->type == Pad) || (k->x + k->w <= lo) || (k->x > hi)) {
+            continue;
+        }
+        out[n++] = k;
+    }
+    if (xb < xa) {
+        for (int i = 0; i < n / 2; i++) {
+            struct key *tmp = out[i];
+            out[i] = out[n - 1 - i];
+            out[n - 1 - i] = tmp;
+        }
+    }
+    return n;
+}
+
+/* Keys crossed by the segment from (x0, y0) to (x1, y1), in order. Rows are
+ * bands of equal height, so the segment is cut where it crosses from one row
+ * to the next and each piece only scans the keys of its own row. */
+static int
+kbd_segment_keys(struct kbd *kb, int x0, int y0, int x1, int y1,
+                 struct key **out, int max)
+{
+    struct layout *l = kb->layout;
+    if (!l->rows || !l->keyheight) {
+        return 0;
+    }
+    double dx = x1 - x0, dy = y1 - y0;
+    int r0 = (int)floor((double)(y0 - (int)l->y_offset) / l->keyheight);
+    int r1 = (int)floor((double)(y1 - (int)l->y_offset) / l->keyheight);
+    int step = (r1 >= r0) ? 1 : -1;
+
+    int n = 0;
+    for (int row = r0;; row += step) {
+        // the piece of the segment inside this row, as fractions of it
+        double t_in = 0.0, t_out = 1.0;
+        if (row != r0) {
+            int edge = (step > 0) ? row : row + 1;
+            t_in = (l->y_offset + edge * (double)l->keyheight - y0) / dy;
+        }
+        if (row != r1) {
+            int edge = (step > 0) ? row + 1 : row;
+            t_out = (l->y_offset + edge * (double)l->keyheight - y0) / dy;
+        }
+        if (row >= 0 && row < l->rows_len) {
+            n += kbd_row_keys(l->rows[row], x0 + dx * t_in, x0 + dx * t_out,
+                              out + n, max - n);
+        }
+        if (row == r1) {
+            break;
+        }
+    }
+    return n;
+}
+
 size_t
 kbd_get_layer_index(struct kbd *kb, struct layout *l)
 {
@@ -343,21 +552,19 @@ kbd_unpress_key(struct kbd *kb, uint32_t time)
         if (unlatch_altgr) kb->mods ^= AltGr;
 
         if (unlatch_shift||unlatch_ctrl||unlatch_alt||unlatch_super||unlatch_altgr) {
-            zwp_virtual_keyboard_v1_modifiers(kb->vkbd, kb->mods, 0, 0, 0);
+            kbd_send_modifiers(kb, kb->mods);
         }
 
         if (kb->last_press->type == Copy) {
-            zwp_virtual_keyboard_v1_key(kb->vkbd, time, 127, // COMP key
-                                        WL_KEYBOARD_KEY_STATE_RELEASED);
+            kbd_send_key(kb, time, 127, // COMP key
+                         WL_KEYBOARD_KEY_STATE_RELEASED);
         } else {
             if ((kb->shift_space_is_tab) && (kb->last_press->code == KEY_SPACE) && (unlatch_shift)) {
                 // shift + space is tab
-                zwp_virtual_keyboard_v1_key(kb->vkbd, time, KEY_TAB,
-                                            WL_KEYBOARD_KEY_STATE_RELEASED);
+                kbd_send_key(kb, time, KEY_TAB, WL_KEYBOARD_KEY_STATE_RELEASED);
             } else {
-                zwp_virtual_keyboard_v1_key(kb->vkbd, time,
-                                            kb->last_press->code,
-                                            WL_KEYBOARD_KEY_STATE_RELEASED);
+                kbd_send_key(kb, time, kb->last_press->code,
+                             WL_KEYBOARD_KEY_STATE_RELEASED);
             }
         }
 
@@ -365,7 +572,7 @@ kbd_unpress_key(struct kbd *kb, uint32_t time)
             kb->compose = 0;
             kbd_switch_layout(kb, kb->last_abc_layout, kb->last_abc_index);
         } else if (unlatch_shift||unlatch_ctrl||unlatch_alt||unlatch_super||unlatch_altgr) {
-            kbd_draw_layout(kb);
+            kbd_schedule_layout(kb);
         } else {
             kbd_draw_key(kb, kb->last_press, Unpress);
         }
@@ -378,11 +585,12 @@ void
 kbd_release_key(struct kbd *kb, uint32_t time)
 {
     kbd_unpress_key(kb, time);
+    kb->intersect_tracking = false;
     if (kb->print_intersect && kb->last_swipe) {
         printf("\n");
         // Important so autocompleted words get typed in time
         fflush(stdout);
-        kbd_draw_layout(kb);
+        kbd_schedule_layout(kb);
         kb->last_swipe = NULL;
     }
 
@@ -400,12 +608,26 @@ kbd_motion_key(struct kbd *kb, uint32_t time, uint32_t x, uint32_t y)
             // Redraw last press as a swipe.
             kbd_draw_key(kb, kb->last_swipe, Swipe);
         }
-        struct key *intersect_key;
-        intersect_key = kbd_get_key(kb, x, y);
-        if (intersect_key && (!kb->last_swipe ||
-                              intersect_key->label != kb->last_swipe->label)) {
-            kbd_print_key_stdout(kb, intersect_key);
-            kb->last_swipe = intersect_key;
+        // report every key crossed since the previous sample, not only the
+        // one under this one, so fast swipes don't skip any
+        struct key *crossed[KBD_MAX_CROSSED_KEYS];
+        int n = 0;
+        if (kb->intersect_tracking) {
+            n = kbd_segment_keys(kb, kb->intersect_x, kb->intersect_y, x, y,
+                                 crossed, KBD_MAX_CROSSED_KEYS);
+        } else if ((crossed[0] = kbd_get_key(kb, x, y))) {
+            n = 1;
+        }
+        kb->intersect_x = (int)x;
+        kb->intersect_y = (int)y;
+        kb->intersect_tracking = true;
+
+        for (int i = 0; i < n; i++) {
+            if (crossed[i] == kb->last_swipe) {
+                continue;
+            }
+            kbd_print_key_stdout(kb, crossed[i]);
+            kb->last_swipe = crossed[i];
             kbd_draw_key(kb, kb->last_swipe, Swipe);
         }
     } else {
@@ -442,25 +664,22 @@ kbd_press_key(struct kbd *kb, struct key *k, uint32_t time)
     case Code:
         if (k->code_mod) {
             if (k->reset_mod) {
-                zwp_virtual_keyboard_v1_modifiers(kb->vkbd, k->code_mod, 0, 0,
-                                                  0);
+                kbd_send_modifiers(kb, k->code_mod);
             } else {
-                zwp_virtual_keyboard_v1_modifiers(
-                    kb->vkbd, kb->mods ^ k->code_mod, 0, 0, 0);
+                kbd_send_modifiers(kb, kb->mods ^ k->code_mod);
             }
         } else {
-            zwp_virtual_keyboard_v1_modifiers(kb->vkbd, kb->mods, 0, 0, 0);
+            kbd_send_modifiers(kb, kb->mods);
         }
         kb->last_swipe = kb->last_press = k;
         kbd_draw_key(kb, k, Press);
         if ((kb->shift_space_is_tab) && (k->code == KEY_SPACE) && (kb->mods & Shift)) {
             // shift space is tab
-            zwp_virtual_keyboard_v1_modifiers(kb->vkbd, 0, 0, 0, 0);
-            zwp_virtual_keyboard_v1_key(kb->vkbd, time, KEY_TAB,
-                                        WL_KEYBOARD_KEY_STATE_PRESSED);
+            kbd_send_modifiers(kb, 0);
+            kbd_send_key(kb, time, KEY_TAB, WL_KEYBOARD_KEY_STATE_PRESSED);
         } else {
-            zwp_virtual_keyboard_v1_key(kb->vkbd, time, kb->last_press->code,
-                                        WL_KEYBOARD_KEY_STATE_PRESSED);
+            kbd_send_key(kb, time, kb->last_press->code,
+                         WL_KEYBOARD_KEY_STATE_PRESSED);
         }
         if (kb->print || kb->print_intersect)
             kbd_print_key_stdout(kb, k);
@@ -473,7 +692,7 @@ kbd_press_key(struct kbd *kb, struct key *k, uint32_t time)
     case Mod:
         kb->mods ^= k->code;
         if ((k->code == Shift) || (k->code == CapsLock)) {
-            kbd_draw_layout(kb);
+            kbd_schedule_layout(kb);
         } else {
             if (kb->mods & k->code) {
                 kbd_draw_key(kb, k, Press);
@@ -481,7 +700,7 @@ kbd_press_key(struct kbd *kb, struct key *k, uint32_t time)
                 kbd_draw_key(kb, k, Unpress);
             }
         }
-        zwp_virtual_keyboard_v1_modifiers(kb->vkbd, kb->mods, 0, 0, 0);
+        kbd_send_modifiers(kb, kb->mods);
         break;
     case Layout:
         // switch to the layout determined by the key
@@ -535,9 +754,9 @@ kbd_press_key(struct kbd *kb, struct key *k, uint32_t time)
             fprintf(stderr, "pressing copy key\n");
         create_and_upload_keymap(kb, kb->layout->keymap_name, k->code,
                                  k->code_mod);
-        zwp_virtual_keyboard_v1_modifiers(kb->vkbd, kb->mods, 0, 0, 0);
-        zwp_virtual_keyboard_v1_key(kb->vkbd, time, 127, // COMP key
-                                    WL_KEYBOARD_KEY_STATE_PRESSED);
+        kbd_send_modifiers(kb, kb->mods);
+        kbd_send_key(kb, time, 127, // COMP key
+                     WL_KEYBOARD_KEY_STATE_PRESSED);
         if (kb->print || kb->print_intersect)
             kbd_print_key_stdout(kb, k);
         break;
@@ -600,6 +819,8 @@ kbd_clear_last_popup(struct kbd *kb)
 void
 kbd_draw_key(struct kbd *kb, struct key *k, enum key_draw_type type)
 {
+    if (kb->dirty_layout)
+        return; // the whole layout is repainted at the next frame anyway
     const char *label = ((kb->mods & Shift)||((kb->mods & CapsLock) && 
         strlen(k->label) == 1 && isalpha(k->label[0]))) ? k->shift_label : k->label;
     if (kb->debug)
@@ -643,19 +864,17 @@ static void
 kbd_adjust_suggestion_case(struct kbd *kb, const char *word, uint8_t mods,
                            char out[WVKBD_MAX_TOKEN_BYTES]);
 
+/* Lay out the pills and render them once into the offscreen strip, in
+ * content coordinates. Scrolling then only blits the strip, see
+ * kbd_place_suggestions(). */
 static void
-kbd_draw_suggestions(struct kbd *kb)
+kbd_render_suggestions(struct kbd *kb)
 {
-    if (!kb->suggest_height) {
-        return;
-    }
-
     uint32_t bar_h = kb->suggest_height;
     struct clr_scheme *scheme = &kb->schemes[1];
-    drw_fill_rectangle(kb->surf, scheme->bg, 0, 0, kb->w, bar_h, 0);
 
-    const uint32_t pad_x = 8;
-    const uint32_t pad_y = 6;
+    const uint32_t pad_x = KBD_SUGGEST_PAD_X;
+    const uint32_t pad_y = KBD_SUGGEST_PAD_Y;
     const uint32_t gap_x = 8;
     const uint32_t trash_w = 26;
 
@@ -672,7 +891,7 @@ kbd_draw_suggestions(struct kbd *kb)
 
     kb->suggest_cancel_visible =
         (kb->suggest_mode == WVKBD_SMODE_SWIPE) && has_word;
-    uint32_t reserved_left = 0;
+    kb->suggest_reserved_left = 0;
     if (kb->suggest_cancel_visible && pill_h > 0) {
         uint32_t cancel_w = pill_h;
         if (cancel_w < 32)
@@ -683,13 +902,7 @@ kbd_draw_suggestions(struct kbd *kb)
         kb->suggest_cancel_y = pad_y;
         kb->suggest_cancel_w = cancel_w;
         kb->suggest_cancel_h = pill_h;
-        draw_inset(kb->surf, kb->suggest_cancel_x, kb->suggest_cancel_y,
-                   kb->suggest_cancel_w, kb->suggest_cancel_h, 1, scheme->fg,
-                   scheme->rounding);
-        drw_draw_text(kb->surf, scheme->text, kb->suggest_cancel_x,
-                      kb->suggest_cancel_y, kb->suggest_cancel_w,
-                      kb->suggest_cancel_h, 0, "⊗", scheme->font_description);
-        reserved_left = pad_x + cancel_w + gap_x;
+        kb->suggest_reserved_left = pad_x + cancel_w + gap_x;
     } else {
         kb->suggest_cancel_x = kb->suggest_cancel_y = 0;
         kb->suggest_cancel_w = kb->suggest_cancel_h = 0;
@@ -701,17 +914,14 @@ kbd_draw_suggestions(struct kbd *kb)
         kb->suggest_pill_w[i] = 0;
     }
 
-    uint32_t widths[WVKBD_MAX_SUGGESTIONS];
-    for (int i = 0; i < WVKBD_MAX_SUGGESTIONS; i++) {
-        widths[i] = 0;
-    }
-
     int pills = 0;
     double pills_w = 0.0;
     char disp[WVKBD_MAX_TOKEN_BYTES];
+    const char *words[WVKBD_MAX_SUGGESTIONS];
     for (int i = 0; i < kb->suggestions_len; i++) {
         const struct wvkbd_suggestion *s = &kb->suggestions[i];
         const char *word = kbd_suggestion_word(s);
+        words[i] = word;
         if (!word || !word[0]) {
             continue;
         }
@@ -732,41 +942,32 @@ kbd_draw_suggestions(struct kbd *kb)
             pill_w = 90;
         if (pill_w > 260)
             pill_w = 260;
-        widths[i] = pill_w;
+        kb->suggest_pill_w[i] = pill_w;
+        kb->suggest_pill_cx[i] = (double)pad_x + pills_w;
         pills++;
-        pills_w += (double)pill_w;
+        pills_w += (double)(pill_w + gap_x);
     }
 
-    if (pills > 1) {
-        pills_w += (double)gap_x * (double)(pills - 1);
+    if (pills > 0) {
+        pills_w -= (double)gap_x;
     }
-
-    double avail_w = (reserved_left < kb->w) ? (double)(kb->w - reserved_left)
-                                             : 0.0;
     kb->suggest_content_width = pills_w + (double)(2 * pad_x);
-    double max_scroll = kb->suggest_content_width - avail_w;
-    if (max_scroll < 0.0) {
-        max_scroll = 0.0;
-    }
-    if (kb->suggest_scroll_x < 0.0) {
-        kb->suggest_scroll_x = 0.0;
-    }
-    if (kb->suggest_scroll_x > max_scroll) {
-        kb->suggest_scroll_x = max_scroll;
-    }
 
-    double x = 0.0;
-    if (max_scroll <= 0.0) {
-        kb->suggest_scroll_x = 0.0;
-        x = (double)reserved_left + (avail_w - pills_w) / 2.0;
-    } else {
-        x = (double)reserved_left + (double)pad_x - kb->suggest_scroll_x;
+    struct drwsurf *strip = &kb->suggest_strip;
+    uint32_t strip_w = (uint32_t)ceil(kb->suggest_content_width);
+    // keep the image surface while the size holds, the fill below clears it
+    if (!kb->suggest_strip_buf.cairo_surf || strip->scale != kb->scale ||
+        strip->width != (uint32_t)ceil(strip_w * kb->scale) ||
+        strip->height != (uint32_t)ceil(bar_h * kb->scale)) {
+        drwsurf_resize_offscreen(strip, strip_w, bar_h, kb->scale);
     }
+    drw_fill_rectangle(strip, scheme->bg, 0, 0, strip_w, bar_h, 0);
 
     for (int i = 0; i < kb->suggestions_len; i++) {
         const struct wvkbd_suggestion *s = &kb->suggestions[i];
-        const char *word = kbd_suggestion_word(s);
-        if (!word || !word[0]) {
+        const char *word = words[i];
+        uint32_t pill_w = kb->suggest_pill_w[i];
+        if (!word || !word[0] || pill_w == 0) {
             continue;
         }
         if (s->kind == WVKBD_SUGGEST_WORD) {
@@ -776,44 +977,115 @@ kbd_draw_suggestions(struct kbd *kb)
             }
         }
 
-        uint32_t pill_w = widths[i];
-        if (pill_w == 0) {
-            continue;
-        }
-
-        uint32_t pill_x = (uint32_t)lround(x);
+        uint32_t pill_x = (uint32_t)lround(kb->suggest_pill_cx[i]);
         uint32_t pill_y = pad_y;
-        kb->suggest_pill_x[i] = pill_x;
-        kb->suggest_pill_w[i] = pill_w;
-
-        if ((double)pill_x + (double)pill_w < -64.0 ||
-            pill_x > kb->w + 64) {
-            x += pill_w + gap_x;
-            continue;
-        }
-
-        draw_inset(kb->surf, pill_x, pill_y, pill_w, pill_h, 1, scheme->fg,
+        draw_inset(strip, pill_x, pill_y, pill_w, pill_h, 1, scheme->fg,
                    scheme->rounding);
 
         uint32_t afford_w = (s->kind == WVKBD_SUGGEST_WORD) ? trash_w : 0;
         uint32_t text_area_w = pill_w - afford_w;
-        drw_draw_text(kb->surf, scheme->text, pill_x, pill_y, text_area_w,
+        drw_draw_text(strip, scheme->text, pill_x, pill_y, text_area_w,
                       pill_h, 4, word, scheme->font_description);
 
         if (s->kind == WVKBD_SUGGEST_WORD) {
             uint32_t trash_x = pill_x + pill_w - trash_w;
-            drw_draw_text(kb->surf, scheme->text, trash_x, pill_y, trash_w,
+            drw_draw_text(strip, scheme->text, trash_x, pill_y, trash_w,
                           pill_h, 2, "×", scheme->font_description);
         }
+    }
+    kb->suggest_strip_valid = true;
+}
+
+/* Clamp the scroll offset and show the rendered strip at it */
+static void
+kbd_place_suggestions(struct kbd *kb)
+{
+    uint32_t bar_h = kb->suggest_height;
+    struct clr_scheme *scheme = &kb->schemes[1];
+    drw_fill_rectangle(kb->surf, scheme->bg, 0, 0, kb->w, bar_h, 0);
+
+    if (kb->suggest_cancel_visible) {
+        draw_inset(kb->surf, kb->suggest_cancel_x, kb->suggest_cancel_y,
+                   kb->suggest_cancel_w, kb->suggest_cancel_h, 1, scheme->fg,
+                   scheme->rounding);
+        drw_draw_text(kb->surf, scheme->text, kb->suggest_cancel_x,
+                      kb->suggest_cancel_y, kb->suggest_cancel_w,
+                      kb->suggest_cancel_h, 0, "⊗", scheme->font_description);
+    }
+
+    uint32_t reserved_left = kb->suggest_reserved_left;
+    double pills_w = kb->suggest_content_width - 2 * KBD_SUGGEST_PAD_X;
+    double avail_w = (reserved_left < kb->w) ? (double)(kb->w - reserved_left)
+                                             : 0.0;
+    double max_scroll = kb->suggest_content_width - avail_w;
+    if (max_scroll < 0.0) {
+        max_scroll = 0.0;
+    }
+    if (kb->suggest_scroll_x < 0.0) {
+        kb->suggest_scroll_x = 0.0;
+    }
+    if (kb->suggest_scroll_x > max_scroll) {
+        kb->suggest_scroll_x = max_scroll;
+    }
+
+    // screen position of the left edge of the strip
+    double origin = 0.0;
+    if (max_scroll <= 0.0) {
+        kb->suggest_scroll_x = 0.0;
+        origin = (double)reserved_left + (avail_w - pills_w) / 2.0 -
+                 KBD_SUGGEST_PAD_X;
+    } else {
+        origin = (double)reserved_left - kb->suggest_scroll_x;
+    }
+
+    for (int i = 0; i < kb->suggestions_len; i++) {
+        if (kb->suggest_pill_w[i]) {
+            kb->suggest_pill_x[i] =
+                (uint32_t)lround(origin + kb->suggest_pill_cx[i]);
+        }
+    }
 
-        x += pill_w + gap_x;
+    long left = lround(origin);
+    long right = left + (long)ceil(kb->suggest_content_width);
+    long from = left > (long)reserved_left ? left : (long)reserved_left;
+    long to = right < (long)kb->w ? right : (long)kb->w;
+    if (to > from) {
+        drw_blit(kb->surf, &kb->suggest_strip, (uint32_t)(from - left), 0,
+                 (uint32_t)from, 0, (uint32_t)(to - from), bar_h);
     }
 }
 
 static void
-kbd_draw_trail(struct kbd *kb)
+kbd_draw_suggestions(struct kbd *kb)
+{
+    if (!kb->suggest_height) {
+        return;
+    }
+    kbd_render_suggestions(kb);
+    kbd_place_suggestions(kb);
+}
+
+/* Redraw the bar after a change of scroll offset only */
+static void
+kbd_scroll_suggestions(struct kbd *kb)
+{
+    if (!kb->suggest_height) {
+        return;
+    }
+    if (!kb->suggest_strip_valid) {
+        kbd_render_suggestions(kb);
+    }
+    kbd_place_suggestions(kb);
+}
+
+static void
+kbd_paint_trail(struct kbd *kb)
 {
-    if (!kb || !kb->trail_enabled || kb->swipe_points_len < 2 ||
+    if (!kb) {
+        return;
+    }
+    kb->trail_w = kb->trail_h = 0;
+    if (!kb->trail_enabled || kb->swipe_points_len < 2 ||
         (kb->trail_fade_ms == 0 && kb->trail_fade_distance_px <= 0.0)) {
         return;
     }
@@ -837,25 +1109,15 @@ kbd_draw_trail(struct kbd *kb)
     double xs[WVKBD_MAX_SWIPE_POINTS];
     double ys[WVKBD_MAX_SWIPE_POINTS];
     uint8_t alphas[WVKBD_MAX_SWIPE_POINTS];
-    double dist_to_end[WVKBD_MAX_SWIPE_POINTS];
-
-    if (kb->trail_fade_distance_px > 0.0) {
-        dist_to_end[kb->swipe_points_len - 1] = 0.0;
-        for (int i = kb->swipe_points_len - 2; i >= 0; i--) {
-            double dx = kb->swipe_points[i + 1].x - kb->swipe_points[i].x;
-            double dy = kb->swipe_points[i + 1].y - kb->swipe_points[i].y;
-            dist_to_end[i] = dist_to_end[i + 1] + hypot(dx, dy);
-        }
-    } else {
-        for (int i = 0; i < kb->swipe_points_len; i++) {
-            dist_to_end[i] = 0.0;
-        }
-    }
-
-    for (int i = 0; i < kb->swipe_points_len; i++) {
-        xs[i] = kb->swipe_points[i].x;
-        ys[i] = kb->swipe_points[i].y;
 
+    // Both fades only grow towards the end of the path, so walk it backwards
+    // and stop at the first invisible point: only that tail is drawn.
+    int last = kb->swipe_points_len - 1;
+    double total = kb->swipe_dist[last];
+    double min_x = kb->swipe_points[last].x, max_x = min_x;
+    double min_y = kb->swipe_points[last].y, max_y = min_y;
+    int first = last;
+    for (int i = last; i >= 0; i--) {
         double t_time = 1.0;
         if (kb->trail_fade_ms > 0) {
             uint32_t dt = (now >= kb->swipe_points[i].time_ms)
@@ -866,7 +1128,8 @@ kbd_draw_trail(struct kbd *kb)
 
         double t_dist = 1.0;
         if (kb->trail_fade_distance_px > 0.0) {
-            t_dist = 1.0 - (dist_to_end[i] / kb->trail_fade_distance_px);
+            t_dist = 1.0 - ((total - kb->swipe_dist[i]) /
+                            kb->trail_fade_distance_px);
         }
 
         double t = t_time < t_dist ? t_time : t_dist;
@@ -874,11 +1137,227 @@ kbd_draw_trail(struct kbd *kb)
             t = 0.0;
         if (t > 1.0)
             t = 1.0;
+
+        // the segment ending at an invisible point is invisible too, but
+        // the point itself still anchors the first visible segment
+        xs[i] = kb->swipe_points[i].x;
+        ys[i] = kb->swipe_points[i].y;
         alphas[i] = (uint8_t)lrint(t * 255.0);
+        min_x = fmin(min_x, xs[i]);
+        max_x = fmax(max_x, xs[i]);
+        min_y = fmin(min_y, ys[i]);
+        max_y = fmax(max_y, ys[i]);
+        first = i;
+        if (!alphas[i])
+            break;
+    }
+    if (last - first < 1)
+        return;
+
+    drw_over_polyline(kb->trail_surf ? kb->trail_surf : kb->surf,
+                      kb->trail_color, kb->trail_width_px,
+                      xs + first, ys + first, alphas + first,
+                      (size_t)(last - first + 1));
+
+    // remember what the trail covers so the next frame can erase it
+    double pad = kb->trail_width_px + 4.0;
+    kb->trail_x = (uint32_t)fmax(0.0, floor(min_x - pad));
+    kb->trail_y = (uint32_t)fmax(0.0, floor(min_y - pad));
+    kb->trail_w = (uint32_t)ceil(max_x + pad) - kb->trail_x;
+    kb->trail_h = (uint32_t)ceil(max_y + pad) - kb->trail_y;
+}
+
+static enum key_draw_type
+kbd_key_draw_type(struct kbd *kb, struct key *k)
+{
+    if ((k->type == Mod && kb->mods & k->code) ||
+        (k->type == Compose && kb->compose) || (k == kb->preview_key)) {
+        return Press;
+    }
+    return None;
+}
+
+/* Repaint everything but the trail inside the given area */
+static void
+kbd_draw_region(struct kbd *kb, uint32_t x, uint32_t y, uint32_t w,
+                uint32_t h)
+{
+    struct layout *l = kb->layout;
+    if (kb->dirty_layout || x >= kb->w || y >= kb->h || !w || !h) {
+        return;
+    }
+    if (x + w > kb->w)
+        w = kb->w - x;
+    if (y + h > kb->h)
+        h = kb->h - y;
+
+    drw_fill_rectangle(kb->surf, kb->schemes[0].bg, x, y, w, h, 0);
+    if (y < kb->suggest_height) {
+        kbd_draw_suggestions(kb);
+    }
+    if (!l->rows || !l->keyheight || y + h <= l->y_offset) {
+        return;
+    }
+
+    uint32_t first = (y > l->y_offset) ? (y - l->y_offset) / l->keyheight : 0;
+    uint32_t last = (y + h - 1 - l->y_offset) / l->keyheight;
+    if (last >= l->rows_len)
+        last = l->rows_len - 1;
+    for (uint32_t row = first; row <= last; row++) {
+        struct key *k = l->rows[row];
+        while ((k->type != Last) && (k->type != EndRow)) {
+            if ((k->type != Pad) && k->w && (k->x < x + w) &&
+                (k->x + k->w > x) && (k->y < y + h) && (k->y + k->h > y)) {
+                kbd_draw_key(kb, k, kbd_key_draw_type(kb, k));
+            }
+            k++;
+        }
+    }
+}
+
+void
+kbd_draw_trail(struct kbd *kb)
+{
+    if (kb->trail_surf) {
+        // the keys underneath live on another surface, just wipe the overlay
+        if (kb->trail_w && kb->trail_h)
+            drw_do_clear(kb->trail_surf, kb->trail_x, kb->trail_y,
+                         kb->trail_w, kb->trail_h);
+    } else if (kb->trail_w && kb->trail_h) {
+        kbd_draw_region(kb, kb->trail_x, kb->trail_y, kb->trail_w,
+                        kb->trail_h);
+    }
+    kbd_paint_trail(kb);
+}
+
+static void
+kbd_draw_suggestion_bar(struct kbd *kb)
+{
+    if (!kb->trail_surf && kb->trail_h && kb->trail_y < kb->suggest_height) {
+        // the trail reaches into the bar, repaint both together
+        kbd_draw_trail(kb);
+    } else {
+        kbd_draw_suggestions(kb);
+    }
+}
+
+static struct kbd_layout_image *
+kbd_layout_image(struct kbd *kb)
+{
+    uint8_t mods = kb->mods & (Shift | CapsLock);
+    struct kbd_layout_image *victim = &kb->layout_images[0];
+    for (int i = 0; i < WVKBD_LAYOUT_CACHE_SIZE; i++) {
+        struct kbd_layout_image *img = &kb->layout_images[i];
+        if (img->surf && img->layout == kb->layout && img->mods == mods) {
+            img->last_used = ++kb->layout_image_clock;
+            return img;
+        }
+        if (victim->surf &&
+            (!img->surf || img->last_used < victim->last_used))
+            victim = img;
+    }
+    if (victim->surf)
+        cairo_surface_destroy(victim->surf);
+    victim->surf = NULL;
+    victim->layout = kb->layout;
+    victim->mods = mods;
+    victim->last_used = ++kb->layout_image_clock;
+    return victim;
+}
+
+void
+kbd_flush_layout_images(struct kbd *kb)
+{
+    for (int i = 0; i < WVKBD_LAYOUT_CACHE_SIZE; i++) {
+        if (kb->layout_images[i].surf)
+            cairo_surface_destroy(kb->layout_images[i].surf);
+        kb->layout_images[i].surf = NULL;
+    }
+}
+
+uint64_t
+kbd_monotonic_ms(void)
+{
+    struct timespec ts = {0};
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return 0;
+    }
+    return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
+}
+
+void
+kbd_set_refresh(struct kbd *kb, int32_t refresh_mhz)
+{
+    kb->frame_ms = (refresh_mhz > 0) ? (uint32_t)(1000000 / refresh_mhz) : 16;
+    if (!kb->frame_ms) {
+        kb->frame_ms = 1;
+    }
+}
+
+/* Animations advance on frame callbacks only and stop asking for frames as
+ * soon as nothing moves, so an idle keyboard never wakes up */
+static bool
+kbd_animating(struct kbd *kb)
+{
+    if (kbd_suggest_flinging(kb)) {
+        return true;
+    }
+    if (!kb->trail_enabled || kb->swipe_points_len < 2) {
+        return false;
+    }
+    // without a time fade a trail only changes when points are added
+    return kb->trail_dirty ||
+           (kb->trail_fade_ms > 0 && kb->trail_w && kb->trail_h);
+}
+
+static void
+kbd_schedule_animation(struct kbd *kb)
+{
+    if (kbd_animating(kb)) {
+        drwsurf_request_render(kb->surf);
+    }
+}
+
+static void
+kbd_animate(struct kbd *kb)
+{
+    uint64_t now = kbd_monotonic_ms();
+
+    if (kb->trail_enabled && (kb->trail_dirty || kb->trail_h)) {
+        kb->trail_dirty = false;
+        if (kb->trail_last_mono_ms && kb->trail_last_input_ms) {
+            kb->trail_now_ms = kb->trail_last_input_ms +
+                               (uint32_t)(now - kb->trail_last_mono_ms);
+        }
+        kbd_draw_trail(kb);
+        if (kb->trail_surf) {
+            drwsurf_present(kb->trail_surf);
+        }
+    }
+    kbd_suggest_fling_step(kb, now);
+}
+
+static void
+kbd_render(void *data)
+{
+    struct kbd *kb = data;
+    if (kb->dirty_layout)
+        kbd_draw_layout(kb);
+    kbd_animate(kb);
+    kbd_schedule_animation(kb);
+}
+
+/* Defer a full redraw to the next frame, so that several state changes
+ * within one frame only paint the keyboard once */
+void
+kbd_schedule_layout(struct kbd *kb)
+{
+    if (!kb->surf->attached) {
+        kbd_draw_layout(kb);
+        return;
     }
-
-    drw_over_polyline(kb->surf, kb->trail_color, kb->trail_width_px, xs, ys,
-                      alphas, (size_t)kb->swipe_points_len);
+    kb->dirty_layout = true;
+    drwsurf_request_render(kb->surf);
 }
 
 void
@@ -886,27 +1365,41 @@ kbd_draw_layout(struct kbd *kb)
 {
     struct drwsurf *d = kb->surf;
     struct key *next_key = kb->layout->keys;
+    kb->dirty_layout = false;
     if (kb->debug)
         fprintf(stderr, "Draw layout\n");
 
-    drw_fill_rectangle(d, kb->schemes[0].bg, 0, 0, kb->w, kb->h, 0);
-    kbd_draw_suggestions(kb);
+    uint32_t keys_y = kb->suggest_height;
+    uint32_t keys_h = (kb->h > keys_y) ? kb->h - keys_y : 0;
+    struct kbd_layout_image *img = kbd_layout_image(kb);
 
-    while (next_key->type != Last) {
-        if ((next_key->type == Pad) || (next_key->type == EndRow)) {
+    if (img->surf) {
+        drw_restore_region(d, img->surf, 0, keys_y, kb->w, keys_h);
+    } else {
+        // draw every key released once and keep the result for next time
+        drw_fill_rectangle(d, kb->schemes[0].bg, 0, 0, kb->w, kb->h, 0);
+        while (next_key->type != Last) {
+            if ((next_key->type != Pad) && (next_key->type != EndRow)) {
+                kbd_draw_key(kb, next_key, None);
+            }
             next_key++;
-            continue;
         }
-        if ((next_key->type == Mod && kb->mods & next_key->code) ||
-            (next_key->type == Compose && kb->compose)) {
-            kbd_draw_key(kb, next_key, Press);
-        } else {
-            kbd_draw_key(kb, next_key, None);
+        if (keys_h)
+            img->surf = drw_save_region(d, 0, keys_y, kb->w, keys_h);
+        next_key = kb->layout->keys;
+    }
+    kbd_draw_suggestions(kb);
+
+    while (next_key->type != Last) {
+        if ((next_key->type != Pad) && (next_key->type != EndRow) &&
+            kbd_key_draw_type(kb, next_key) != None) {
+            kbd_draw_key(kb, next_key, kbd_key_draw_type(kb, next_key));
         }
         next_key++;
     }
 
-    kbd_draw_trail(kb);
+    if (!kb->trail_surf)
+        kbd_paint_trail(kb);
 }
 
 void
@@ -917,6 +1410,13 @@ kbd_resize(struct kbd *kb, struct layout *layouts, uint8_t layoutcount)
 
     drwsurf_resize(kb->surf, kb->w, kb->h, kb->scale);
     drwsurf_resize(kb->popup_surf, kb->w, kb->h * 2, kb->scale);
+    kb->suggest_strip_valid = false;
+    if (kb->trail_surf) {
+        drwsurf_resize(kb->trail_surf, kb->w, kb->h, kb->scale);
+        drw_do_clear(kb->trail_surf, 0, 0, kb->w, kb->h);
+        kb->trail_w = kb->trail_h = 0;
+    }
+    kbd_flush_layout_images(kb);
     for (int i = 0; i < layoutcount; i++) {
         if (kb->debug) {
             if (layouts[i].name)
@@ -935,6 +1435,25 @@ kbd_resize(struct kbd *kb, struct layout *layouts, uint8_t layoutcount)
         }
         kbd_init_layout(&layouts[i], kb->w, key_h, y_offset);
     }
+
+    // pre-render the labels and key shapes of the layers we can cycle through
+    enum layout_id *layers = kb->landscape ? kb->landscape_layers : kb->layers;
+    for (int i = 0; layers && layers[i] != NumLayouts; i++) {
+        struct key *k = layouts[layers[i]].keys;
+        for (; k->type != Last; k++) {
+            if ((k->type == Pad) || (k->type == EndRow))
+                continue;
+            struct clr_scheme *scheme = &kb->schemes[k->scheme];
+            drw_cache_text(kb->surf, scheme->text, k->w, k->h, KBD_KEY_BORDER,
+                           k->label, scheme->font_description);
+            drw_cache_text(kb->surf, scheme->text, k->w, k->h, KBD_KEY_BORDER,
+                           k->shift_label, scheme->font_description);
+            if (k->w > 2 * KBD_KEY_BORDER && k->h > 2 * KBD_KEY_BORDER)
+                drw_cache_rectangle(kb->surf, k->w - 2 * KBD_KEY_BORDER,
+                                    k->h - 2 * KBD_KEY_BORDER,
+                                    scheme->rounding);
+        }
+    }
     kbd_draw_layout(kb);
 }
 
@@ -1052,6 +1571,49 @@ kbd_commit_token_if_needed(struct kbd *kb)
     kb->current_token_len = 0;
 }
 
+/* Swipe decoding can run on a worker thread, see kbd_swipe_worker_start() */
+struct kbd_swipe_worker {
+    pthread_t thread;
+    pthread_mutex_t predictor_lock; // held around every predictor call
+    pthread_mutex_t lock;           // guards the fields below
+    pthread_cond_t cond;
+    int event_fd;
+    bool quit;
+
+    /* latest request, replaced wholesale by newer ones */
+    bool req_pending;
+    uint32_t req_seq;
+    struct wvkbd_key_pos_map pos;
+    struct wvkbd_point points[WVKBD_MAX_SWIPE_POINTS];
+    int points_len;
+    int points_total;
+    char token[WVKBD_MAX_TOKEN_BYTES];
+    char last_word[WVKBD_MAX_TOKEN_BYTES];
+    int max;
+
+    /* latest result */
+    bool res_ready;
+    uint32_t res_seq;
+    int res_points_total;
+    double res_cost_ms;
+    struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT];
+    int cands_len;
+};
+
+static void
+kbd_predictor_lock(struct kbd *kb)
+{
+    if (kb->swipe_worker)
+        pthread_mutex_lock(&kb->swipe_worker->predictor_lock);
+}
+
+static void
+kbd_predictor_unlock(struct kbd *kb)
+{
+    if (kb->swipe_worker)
+        pthread_mutex_unlock(&kb->swipe_worker->predictor_lock);
+}
+
 static void
 kbd_suggestions_from_candidates(struct kbd *kb, struct wvkbd_candidate *cands,
                                 int cands_len)
@@ -1086,9 +1648,12 @@ kbd_suggestions_from_candidates(struct kbd *kb, struct wvkbd_candidate *cands,
 
     bool can_add = (kb->current_token_len > 0) &&
                    (kb->suggestions_len < WVKBD_MAX_SUGGESTIONS);
-    if (can_add && kb->predictor &&
-        wvkbd_predictor_user_has_word(kb->predictor, kb->current_token)) {
-        can_add = false;
+    if (can_add && kb->predictor) {
+        kbd_predictor_lock(kb);
+        if (wvkbd_predictor_user_has_word(kb->predictor, kb->current_token)) {
+            can_add = false;
+        }
+        kbd_predictor_unlock(kb);
     }
     if (can_add) {
         char tok[WVKBD_MAX_TOKEN_BYTES] = {0};
@@ -1130,11 +1695,13 @@ kbd_update_suggestions_prefix(struct kbd *kb)
         return;
     }
     struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT] = {0};
+    kbd_predictor_lock(kb);
     int n = wvkbd_predict_prefix(kb->predictor, kb->current_token, cands,
                                 kb->suggest_visible_count);
+    kbd_predictor_unlock(kb);
     kbd_suggestions_from_candidates(kb, cands, n);
     kb->suggest_mode = WVKBD_SMODE_PREFIX;
-    kbd_draw_layout(kb);
+    kbd_draw_suggestion_bar(kb);
 }
 
 static void
@@ -1147,11 +1714,13 @@ kbd_update_suggestions_next_word(struct kbd *kb)
     }
     const char *lw = kbd_last_context_word(kb);
     struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT] = {0};
+    kbd_predictor_lock(kb);
     int n = wvkbd_predict_next_word(kb->predictor, lw, cands,
                                    kb->suggest_visible_count);
+    kbd_predictor_unlock(kb);
     kbd_suggestions_from_candidates(kb, cands, n);
     kb->suggest_mode = WVKBD_SMODE_NEXT_WORD;
-    kbd_draw_layout(kb);
+    kbd_draw_suggestion_bar(kb);
 }
 
 static void
@@ -1176,24 +1745,342 @@ kbd_build_key_pos_map(struct kbd *kb, struct wvkbd_key_pos_map *pos)
 static void
 kbd_set_pending_swipe_from_suggestions(struct kbd *kb);
 
+static double
+kbd_elapsed_ms(const struct timespec *since)
+{
+    struct timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 +
+           (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+/* Fold the duration of one swipe decode into the running average, and space
+ * mid-gesture refreshes so that decoding stays within its share of time */
+static void
+kbd_swipe_note_cost(struct kbd *kb, double cost_ms)
+{
+    if (kb->swipe_cost_ms <= 0.0) {
+        kb->swipe_cost_ms = cost_ms;
+    } else {
+        kb->swipe_cost_ms += KBD_SWIPE_COST_WEIGHT * (cost_ms - kb->swipe_cost_ms);
+    }
+
+    double interval = kb->swipe_cost_ms * 100.0 / kb->swipe_budget;
+    if (interval < KBD_SWIPE_INTERVAL_MIN_MS) {
+        interval = KBD_SWIPE_INTERVAL_MIN_MS;
+    } else if (interval > KBD_SWIPE_INTERVAL_MAX_MS) {
+        interval = KBD_SWIPE_INTERVAL_MAX_MS;
+    }
+    uint32_t ms = (uint32_t)lrint(interval);
+    if (kb->debug && ms != kb->swipe_interval_ms) {
+        fprintf(stderr,
+                "Swipe suggestions every %u ms (decode %.1f ms, budget %d%%)\n",
+                ms, kb->swipe_cost_ms, kb->swipe_budget);
+    }
+    kb->swipe_interval_ms = ms;
+}
+
 static void
 kbd_update_suggestions_swipe(struct kbd *kb)
 {
     if (!kb || !kb->predictor || kb->swipe_points_len < 2) {
         return;
     }
+    struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT] = {0};
+    const char *lw = kbd_last_context_word(kb);
+    // anything still in flight on the worker is older than this
+    kb->swipe_seq++;
+    kbd_predictor_lock(kb);
+    struct timespec start = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = wvkbd_predict_swipe(kb->predictor, &kb->swipe_pos,
+                               kb->swipe_points, kb->swipe_points_len,
+                               kb->current_token, lw, cands,
+                               kb->suggest_visible_count);
+    double cost_ms = kbd_elapsed_ms(&start);
+    kbd_predictor_unlock(kb);
+    kbd_swipe_note_cost(kb, cost_ms);
+    kb->swipe_decoded_total = kb->swipe_points_total;
+    kbd_suggestions_from_candidates(kb, cands, n);
+    kb->suggest_mode = WVKBD_SMODE_SWIPE;
+    kbd_set_pending_swipe_from_suggestions(kb);
+    kbd_draw_suggestion_bar(kb);
+}
+
+static void *
+kbd_swipe_worker_run(void *data)
+{
+    struct kbd *kb = data;
+    struct kbd_swipe_worker *w = kb->swipe_worker;
     struct wvkbd_key_pos_map pos;
-    kbd_build_key_pos_map(kb, &pos);
+    struct wvkbd_point points[WVKBD_MAX_SWIPE_POINTS];
+    char token[WVKBD_MAX_TOKEN_BYTES];
+    char last_word[WVKBD_MAX_TOKEN_BYTES];
+    struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT];
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->quit) {
+        if (!w->req_pending) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        // take a private snapshot so the main thread can post the next one
+        uint32_t seq = w->req_seq;
+        int points_len = w->points_len;
+        int points_total = w->points_total;
+        int max = w->max;
+        pos = w->pos;
+        memcpy(points, w->points, sizeof(points[0]) * points_len);
+        memcpy(token, w->token, sizeof(token));
+        memcpy(last_word, w->last_word, sizeof(last_word));
+        w->req_pending = false;
+        pthread_mutex_unlock(&w->lock);
+
+        memset(cands, 0, sizeof(cands));
+        pthread_mutex_lock(&w->predictor_lock);
+        struct timespec start = {0};
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int n = wvkbd_predict_swipe(kb->predictor, &pos, points, points_len,
+                                    token, last_word[0] ? last_word : NULL,
+                                    cands, max);
+        double cost_ms = kbd_elapsed_ms(&start);
+        pthread_mutex_unlock(&w->predictor_lock);
+
+        pthread_mutex_lock(&w->lock);
+        if (seq == w->req_seq) {
+            memcpy(w->cands, cands, sizeof(cands));
+            w->cands_len = n;
+            w->res_seq = seq;
+            w->res_points_total = points_total;
+            w->res_cost_ms = cost_ms;
+            w->res_ready = true;
+            uint64_t one = 1;
+            if (write(w->event_fd, &one, sizeof(one)) < 0 && kb->debug)
+                fprintf(stderr, "swipe worker: eventfd write failed\n");
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
 
-    struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT] = {0};
+/* Start decoding swipes on a worker thread. Returns a file descriptor that
+ * becomes readable when suggestions are ready for kbd_swipe_worker_dispatch(),
+ * or -1 if swipes keep being decoded synchronously. */
+int
+kbd_swipe_worker_start(struct kbd *kb)
+{
+    if (!kb->predictor || kb->swipe_worker)
+        return -1;
+    struct kbd_swipe_worker *w = calloc(1, sizeof(*w));
+    if (!w)
+        return -1;
+    w->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (w->event_fd < 0) {
+        free(w);
+        return -1;
+    }
+    pthread_mutex_init(&w->predictor_lock, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    kb->swipe_worker = w;
+    if (pthread_create(&w->thread, NULL, kbd_swipe_worker_run, kb) != 0) {
+        fprintf(stderr, "Could not start swipe worker, decoding inline\n");
+        kb->swipe_worker = NULL;
+        close(w->event_fd);
+        free(w);
+        return -1;
+    }
+    return w->event_fd;
+}
+
+void
+kbd_swipe_worker_stop(struct kbd *kb)
+{
+    struct kbd_swipe_worker *w = kb->swipe_worker;
+    if (!w)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->quit = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    kb->swipe_worker = NULL;
+    close(w->event_fd);
+    free(w);
+}
+
+/* Refresh swipe suggestions mid-gesture, on the worker when there is one */
+static void
+kbd_request_suggestions_swipe(struct kbd *kb)
+{
+    struct kbd_swipe_worker *w = kb->swipe_worker;
+    if (!w) {
+        kbd_update_suggestions_swipe(kb);
+        return;
+    }
+    if (!kb->predictor || kb->swipe_points_len < 2) {
+        return;
+    }
     const char *lw = kbd_last_context_word(kb);
-    int n = wvkbd_predict_swipe(kb->predictor, &pos, kb->swipe_points,
-                               kb->swipe_points_len, kb->current_token, lw,
-                               cands, kb->suggest_visible_count);
+
+    pthread_mutex_lock(&w->lock);
+    w->req_seq = ++kb->swipe_seq;
+    w->req_pending = true;
+    w->pos = kb->swipe_pos;
+    memcpy(w->points, kb->swipe_points,
+           sizeof(kb->swipe_points[0]) * kb->swipe_points_len);
+    w->points_len = kb->swipe_points_len;
+    w->points_total = kb->swipe_points_total;
+    strncpy(w->token, kb->current_token, sizeof(w->token) - 1);
+    w->token[sizeof(w->token) - 1] = '\0';
+    w->last_word[0] = '\0';
+    if (lw) {
+        strncpy(w->last_word, lw, sizeof(w->last_word) - 1);
+        w->last_word[sizeof(w->last_word) - 1] = '\0';
+    }
+    w->max = kb->suggest_visible_count;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void
+kbd_swipe_worker_dispatch(struct kbd *kb)
+{
+    struct kbd_swipe_worker *w = kb->swipe_worker;
+    if (!w)
+        return;
+    uint64_t count;
+    if (read(w->event_fd, &count, sizeof(count)) < 0)
+        return;
+
+    struct wvkbd_candidate cands[WVKBD_PREDICT_MAX_OUT];
+    int n = 0, points_total = 0;
+    double cost_ms = 0.0;
+    bool fresh = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->res_ready) {
+        w->res_ready = false;
+        fresh = (w->res_seq == kb->swipe_seq);
+        n = w->cands_len;
+        points_total = w->res_points_total;
+        cost_ms = w->res_cost_ms;
+        memcpy(cands, w->cands, sizeof(cands));
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (cost_ms > 0.0) {
+        kbd_swipe_note_cost(kb, cost_ms);
+    }
+
+    // results for a gesture that has since ended or moved on are dropped
+    if (!fresh || !kbd_contact_in_mode(kb, KBD_INPUT_SWIPE)) {
+        return;
+    }
+    kb->swipe_decoded_total = points_total;
     kbd_suggestions_from_candidates(kb, cands, n);
     kb->suggest_mode = WVKBD_SMODE_SWIPE;
     kbd_set_pending_swipe_from_suggestions(kb);
-    kbd_draw_layout(kb);
+    kbd_draw_suggestion_bar(kb);
+}
+
+/* Make room in a full swipe path by dropping the points that shape it the
+ * least: the one spanning the smallest triangle with its neighbours goes
+ * first (Visvalingam), so corners survive. The first point and the last
+ * KBD_SWIPE_TAIL_POINTS, where the gesture is still going, stay untouched.
+ * Cumulative distances are kept as they were, true to the path travelled. */
+static void
+kbd_swipe_simplify(struct kbd *kb, int target)
+{
+    struct wvkbd_point *p = kb->swipe_points;
+    int n = kb->swipe_points_len;
+    int tail = n - KBD_SWIPE_TAIL_POINTS;
+    while (n > target && tail > 1) {
+        int victim = 1;
+        double victim_area = -1.0;
+        for (int i = 1; i < tail; i++) {
+            double ax = (double)p[i].x - p[i - 1].x;
+            double ay = (double)p[i].y - p[i - 1].y;
+            double bx = (double)p[i + 1].x - p[i - 1].x;
+            double by = (double)p[i + 1].y - p[i - 1].y;
+            double area = fabs(ax * by - bx * ay);
+            if (victim_area < 0.0 || area < victim_area) {
+                victim = i;
+                victim_area = area;
+            }
+        }
+        memmove(&p[victim], &p[victim + 1], sizeof(p[0]) * (n - victim - 1));
+        memmove(&kb->swipe_dist[victim], &kb->swipe_dist[victim + 1],
+                sizeof(kb->swipe_dist[0]) * (n - victim - 1));
+        n--;
+        tail--;
+    }
+    kb->swipe_points_len = n;
+}
+
+/* A swipe session spans one gesture: the per-gesture inputs of the decoder
+ * are computed once in kbd_swipe_begin(), points are appended with
+ * kbd_swipe_feed() and kbd_swipe_finish() settles the final suggestions. */
+static void
+kbd_swipe_push(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
+{
+    if (kb->swipe_points_len >= WVKBD_MAX_SWIPE_POINTS) {
+        // simplify a quarter at a time to keep the cost per point low
+        kbd_swipe_simplify(kb, WVKBD_MAX_SWIPE_POINTS * 3 / 4);
+    }
+    int i = kb->swipe_points_len;
+    if (i >= WVKBD_MAX_SWIPE_POINTS) {
+        return;
+    }
+    kb->swipe_points[i] =
+        (struct wvkbd_point){.x = x, .y = y, .time_ms = time_ms};
+    kb->swipe_dist[i] = 0.0;
+    if (i > 0) {
+        double dx = (double)x - kb->swipe_points[i - 1].x;
+        double dy = (double)y - kb->swipe_points[i - 1].y;
+        kb->swipe_dist[i] = kb->swipe_dist[i - 1] + hypot(dx, dy);
+    }
+    kb->swipe_points_len = i + 1;
+    kb->swipe_points_total++;
+}
+
+static void
+kbd_swipe_begin(struct kbd *kb, struct kbd_contact *c, uint32_t time_ms,
+                uint32_t x, uint32_t y)
+{
+    kbd_build_key_pos_map(kb, &kb->swipe_pos);
+    kb->swipe_decoded_total = 0;
+    kb->swipe_points_len = 0;
+    kb->swipe_points_total = 0;
+    kbd_swipe_push(kb, time_ms, c->down_x, c->down_y);
+    kbd_swipe_push(kb, time_ms, x, y);
+    kb->trail_dirty = true;
+    kbd_schedule_animation(kb);
+    kb->swipe_last_suggest_time = time_ms;
+    kbd_request_suggestions_swipe(kb);
+}
+
+static void
+kbd_swipe_feed(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
+{
+    kbd_swipe_push(kb, time_ms, x, y);
+    kb->trail_dirty = true;
+    kbd_schedule_animation(kb);
+    if ((time_ms - kb->swipe_last_suggest_time) > kb->swipe_interval_ms) {
+        kb->swipe_last_suggest_time = time_ms;
+        kbd_request_suggestions_swipe(kb);
+    }
+}
+
+static void
+kbd_swipe_finish(struct kbd *kb)
+{
+    if (kb->swipe_decoded_total == kb->swipe_points_total &&
+        kb->suggest_mode == WVKBD_SMODE_SWIPE) {
+        // the suggestions on display already cover every point
+        kb->swipe_seq++;
+    } else {
+        kbd_update_suggestions_swipe(kb);
+    }
+    kbd_set_pending_swipe_from_suggestions(kb);
 }
 
 static void
@@ -1254,6 +2141,7 @@ kbd_cancel_swipe(struct kbd *kb)
     kb->pending_swipe = false;
     kb->pending_swipe_word[0] = '\0';
     kb->swipe_points_len = 0;
+    kbd_draw_trail(kb);
 
     if (kb->current_token_len > 0) {
         kbd_update_suggestions_prefix(kb);
@@ -1280,13 +2168,16 @@ kbd_top_word_suggestion(struct kbd *kb)
 static void
 kbd_preview_set_key(struct kbd *kb, struct key *k)
 {
-    if (kb->preview_key == k) {
+    struct key *prev = kb->preview_key;
+    if (prev == k) {
         return;
     }
     kb->preview_key = k;
-    kbd_draw_layout(kb);
-    if (kb->preview_key) {
-        kbd_draw_key(kb, kb->preview_key, Press);
+    if (prev) {
+        kbd_draw_key(kb, prev, kbd_key_draw_type(kb, prev));
+    }
+    if (k) {
+        kbd_draw_key(kb, k, Press);
     }
 }
 
@@ -1349,11 +2240,9 @@ static void
 kbd_type_codepoint(struct kbd *kb, uint32_t time_ms, uint32_t cp)
 {
     create_and_upload_keymap(kb, kb->layout->keymap_name, cp, cp);
-    zwp_virtual_keyboard_v1_modifiers(kb->vkbd, 0, 0, 0, 0);
-    zwp_virtual_keyboard_v1_key(kb->vkbd, time_ms, 127,
-                                WL_KEYBOARD_KEY_STATE_PRESSED);
-    zwp_virtual_keyboard_v1_key(kb->vkbd, time_ms, 127,
-                                WL_KEYBOARD_KEY_STATE_RELEASED);
+    kbd_send_modifiers(kb, 0);
+    kbd_send_key(kb, time_ms, 127, WL_KEYBOARD_KEY_STATE_PRESSED);
+    kbd_send_key(kb, time_ms, 127, WL_KEYBOARD_KEY_STATE_RELEASED);
 }
 
 struct wvkbd_char_key {
@@ -1399,7 +2288,7 @@ kbd_build_char_keymap(struct kbd *kb, struct wvkbd_char_key out[128])
 static bool
 kbd_type_text_mapped(struct kbd *kb, uint32_t time_ms, const char *text)
 {
-    if (!kb || !kb->vkbd || !text) {
+    if (!kb || (!kb->vkbd && !kb->recorder) || !text) {
         return false;
     }
 
@@ -1412,48 +2301,145 @@ kbd_type_text_mapped(struct kbd *kb, uint32_t time_ms, const char *text)
         if (c >= 128 || !map[c].has) {
             return false;
         }
-        zwp_virtual_keyboard_v1_modifiers(kb->vkbd, map[c].mods, 0, 0, 0);
-        zwp_virtual_keyboard_v1_key(kb->vkbd, t, map[c].code,
-                                    WL_KEYBOARD_KEY_STATE_PRESSED);
-        zwp_virtual_keyboard_v1_key(kb->vkbd, t, map[c].code,
-                                    WL_KEYBOARD_KEY_STATE_RELEASED);
+        kbd_send_modifiers(kb, map[c].mods);
+        kbd_send_key(kb, t, map[c].code, WL_KEYBOARD_KEY_STATE_PRESSED);
+        kbd_send_key(kb, t, map[c].code, WL_KEYBOARD_KEY_STATE_RELEASED);
         t++;
     }
 
     // Restore OSK modifier state.
-    zwp_virtual_keyboard_v1_modifiers(kb->vkbd, kb->mods, 0, 0, 0);
+    kbd_send_modifiers(kb, kb->mods);
+    return true;
+}
+
+static uint32_t
+kbd_utf8_next(const unsigned char **sp)
+{
+    const unsigned char *s = *sp;
+    uint32_t cp = 0;
+    if (*s < 0x80) {
+        cp = *s;
+        s++;
+    } else if ((*s & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
+        cp = ((*s & 0x1F) << 6) | (s[1] & 0x3F);
+        s += 2;
+    } else if ((*s & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 &&
+               (s[2] & 0xC0) == 0x80) {
+        cp = ((*s & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
+        s += 3;
+    } else if ((*s & 0xF8) == 0xF0 && (s[1] & 0xC0) == 0x80 &&
+               (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) {
+        cp = ((*s & 0x07) << 18) | ((s[1] & 0x3F) << 12) |
+             ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        s += 4;
+    } else {
+        cp = *s;
+        s++;
+    }
+    *sp = s;
+    return cp;
+}
+
+/* Type a whole string through one throwaway keymap that binds every distinct
+ * codepoint of the string to its own keycode, then restore the layout's
+ * keymap. Returns false if the string does not fit in the scratch block. */
+static bool
+kbd_type_text_scratch(struct kbd *kb, uint32_t time_ms, const char *text)
+{
+    uint32_t cps[WVKBD_MAX_SCRATCH_KEYS];
+    uint8_t keys[WVKBD_MAX_TOKEN_BYTES];
+    int cps_len = 0, keys_len = 0;
+
+    const unsigned char *s = (const unsigned char *)text;
+    while (*s) {
+        uint32_t cp = kbd_utf8_next(&s);
+        int idx = 0;
+        while (idx < cps_len && cps[idx] != cp) {
+            idx++;
+        }
+        if (idx == cps_len) {
+            if (cps_len == WVKBD_MAX_SCRATCH_KEYS) {
+                return false;
+            }
+            cps[cps_len++] = cp;
+        }
+        if (keys_len == WVKBD_MAX_TOKEN_BYTES) {
+            return false;
+        }
+        keys[keys_len++] = (uint8_t)idx;
+    }
+    if (!keys_len) {
+        return true;
+    }
+
+    // keycodes start at 9 (evdev 1), names are limited to four characters
+    size_t size = 512 + (size_t)cps_len * 64;
+    char *keymap_str = malloc(size);
+    if (!keymap_str) {
+        return false;
+    }
+    size_t len = snprintf(keymap_str, size,
+                          "xkb_keymap {\n"
+                          "xkb_keycodes \"wvkbd\" {\n"
+                          "minimum = 8;\nmaximum = 255;\n");
+    for (int i = 0; i < cps_len; i++) {
+        len += snprintf(keymap_str + len, size - len, "<W%03d> = %d;\n", i,
+                        i + 9);
+    }
+    len += snprintf(keymap_str + len, size - len,
+                    "};\n"
+                    "xkb_types \"wvkbd\" {\n"
+                    "type \"ONE_LEVEL\" {\n"
+                    "modifiers = none;\n"
+                    "level_name[Level1] = \"Any\";\n"
+                    "};\n"
+                    "};\n"
+                    "xkb_compatibility \"wvkbd\" {\n};\n"
+                    "xkb_symbols \"wvkbd\" {\n");
+    for (int i = 0; i < cps_len; i++) {
+        len += snprintf(keymap_str + len, size - len,
+                        "key <W%03d> { [ U%04X ] };\n", i, cps[i]);
+    }
+    len += snprintf(keymap_str + len, size - len, "};\n};\n");
+
+    int keymap_fd = os_create_sealed_file(keymap_str, len + 1);
+    free(keymap_str);
+    if (keymap_fd < 0) {
+        return false;
+    }
+    if (kb->debug)
+        fprintf(stderr, "Typing %d keys through a %d key scratch keymap\n",
+                keys_len, cps_len);
+    kbd_send_keymap(kb, keymap_fd, len + 1);
+    close(keymap_fd);
+    kb->keymap_current = NULL;
+
+    uint32_t t = time_ms;
+    kbd_send_modifiers(kb, 0);
+    for (int i = 0; i < keys_len; i++) {
+        kbd_send_key(kb, t, keys[i] + 1, WL_KEYBOARD_KEY_STATE_PRESSED);
+        kbd_send_key(kb, t, keys[i] + 1, WL_KEYBOARD_KEY_STATE_RELEASED);
+        t++;
+    }
+
+    create_and_upload_keymap(kb, kb->layout->keymap_name, 0, 0);
+    kbd_send_modifiers(kb, kb->mods);
     return true;
 }
 
 static void
 kbd_type_text_utf8(struct kbd *kb, uint32_t time_ms, const char *text)
 {
-    if (!kb || !kb->vkbd || !text) {
+    if (!kb || (!kb->vkbd && !kb->recorder) || !text) {
+        return;
+    }
+    if (kbd_type_text_scratch(kb, time_ms, text)) {
         return;
     }
     uint32_t t = time_ms;
     const unsigned char *s = (const unsigned char *)text;
     while (*s) {
-        uint32_t cp = 0;
-        if (*s < 0x80) {
-            cp = *s;
-            s++;
-        } else if ((*s & 0xE0) == 0xC0 && (s[1] & 0xC0) == 0x80) {
-            cp = ((*s & 0x1F) << 6) | (s[1] & 0x3F);
-            s += 2;
-        } else if ((*s & 0xF0) == 0xE0 && (s[1] & 0xC0) == 0x80 &&
-                   (s[2] & 0xC0) == 0x80) {
-            cp = ((*s & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
-            s += 3;
-        } else if ((*s & 0xF8) == 0xF0 && (s[1] & 0xC0) == 0x80 &&
-                   (s[2] & 0xC0) == 0x80 && (s[3] & 0xC0) == 0x80) {
-            cp = ((*s & 0x07) << 18) | ((s[1] & 0x3F) << 12) |
-                 ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
-            s += 4;
-        } else {
-            cp = *s;
-            s++;
-        }
+        uint32_t cp = kbd_utf8_next(&s);
         kbd_type_codepoint(kb, t, cp);
         t++;
     }
@@ -1690,98 +2676,236 @@ kbd_set_pending_swipe_from_suggestions(struct kbd *kb)
     }
 }
 
+static bool
+kbd_suggest_flinging(struct kbd *kb)
+{
+    return kb && !kbd_contact_in_mode(kb, KBD_INPUT_SUGGEST_SCROLL) &&
+           kb->suggest_fling_v != 0;
+}
+
+/* Advance a fling of the suggestion bar to now_ms, on the monotonic clock */
+static void
+kbd_suggest_fling_step(struct kbd *kb, uint64_t now_ms)
+{
+    if (!kbd_suggest_flinging(kb)) {
+        return;
+    }
+    uint64_t dt = kb->suggest_fling_last_ms
+                      ? now_ms - kb->suggest_fling_last_ms
+                      : kb->frame_ms;
+    kb->suggest_fling_last_ms = now_ms;
+    if (dt > 100) {
+        dt = 100;
+    }
+
+    double before = kb->suggest_scroll_x;
+    kb->suggest_scroll_x += kb->suggest_fling_v * (double)dt;
+    kb->suggest_fling_v *= pow(KBD_FLING_FRICTION, (double)dt);
+    kbd_scroll_suggestions(kb);
+
+    // stop once slow enough, or when held back by either end of the strip
+    if (fabs(kb->suggest_fling_v) < KBD_FLING_MIN_VELOCITY ||
+        kb->suggest_scroll_x == before) {
+        kb->suggest_fling_v = 0;
+    }
+}
+
 void
-kbd_input_down(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
+kbd_input_down(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+               uint32_t y)
 {
-    if (!kb) {
+    if (!kb || kbd_contact_find(kb, id)) {
+        return;
+    }
+    struct kbd_contact *c = NULL;
+    for (int i = 0; i < KBD_MAX_CONTACTS && !c; i++) {
+        if (!kb->contacts[i].down) {
+            c = &kb->contacts[i];
+        }
+    }
+    if (!c) {
+        return;
+    }
+    // a swipe or a suggestion drag has the keyboard to itself
+    bool busy = kbd_contact_in_mode(kb, KBD_INPUT_SWIPE) ||
+                kbd_contact_in_mode(kb, KBD_INPUT_SUGGEST_SCROLL);
+
+    c->id = id;
+    c->down = true;
+    c->seq = ++kb->contact_seq;
+    c->down_time = time_ms;
+    c->down_x = c->last_x = (int)x;
+    c->down_y = c->last_y = (int)y;
+    c->moved = false;
+    c->key = NULL;
+    if (busy) {
+        c->mode = KBD_INPUT_NONE;
         return;
     }
-    kb->input_down = true;
-    kb->input_mode = (y < kb->suggest_height) ? KBD_INPUT_SUGGEST_SCROLL
-                                              : KBD_INPUT_TAP;
-    kb->input_down_time = time_ms;
-    kb->input_down_x = kb->input_last_x = (int)x;
-    kb->input_down_y = kb->input_last_y = (int)y;
-    kb->input_moved = false;
+    c->mode = (y < kb->suggest_height) ? KBD_INPUT_SUGGEST_SCROLL
+                                       : KBD_INPUT_TAP;
 
     kb->suggest_drag_start_x = (double)x;
     kb->suggest_drag_start_scroll_x = kb->suggest_scroll_x;
+    kb->suggest_drag_last_x = (double)x;
+    kb->suggest_drag_last_time = time_ms;
+    kb->suggest_fling_v = 0;
+    // render the strip afresh once per drag, then only blit it
+    kb->suggest_strip_valid = false;
 
     kb->swipe_points_len = 0;
     kb->swipe_last_suggest_time = 0;
+    kbd_draw_trail(kb);
 
-    if (kb->input_mode == KBD_INPUT_TAP) {
-        struct key *k = kbd_get_key(kb, x, y);
-        kbd_preview_set_key(kb, k);
+    if (c->mode == KBD_INPUT_TAP) {
+        c->key = kbd_get_key(kb, x, y);
+        kbd_preview_set_key(kb, c->key);
     }
 }
 
 void
-kbd_input_motion(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
+kbd_input_motion(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+                 uint32_t y)
 {
-    if (!kb || !kb->input_down) {
+    struct kbd_contact *c = kb ? kbd_contact_find(kb, id) : NULL;
+    if (!c) {
         return;
     }
 
-    int dx = (int)x - kb->input_down_x;
-    int dy = (int)y - kb->input_down_y;
+    int dx = (int)x - c->down_x;
+    int dy = (int)y - c->down_y;
     if ((dx * dx + dy * dy) > (int)(kb->swipe_threshold_px * kb->swipe_threshold_px)) {
-        kb->input_moved = true;
+        c->moved = true;
     }
 
-    kb->input_last_x = (int)x;
-    kb->input_last_y = (int)y;
+    c->last_x = (int)x;
+    c->last_y = (int)y;
 
-    if (kb->input_mode == KBD_INPUT_SUGGEST_SCROLL) {
+    if (c->mode == KBD_INPUT_SUGGEST_SCROLL) {
         double delta = kb->suggest_drag_start_x - (double)x;
         kb->suggest_scroll_x = kb->suggest_drag_start_scroll_x + delta;
-        kbd_draw_layout(kb);
+        if (time_ms > kb->suggest_drag_last_time) {
+            double v = (kb->suggest_drag_last_x - (double)x) /
+                       (double)(time_ms - kb->suggest_drag_last_time);
+            kb->suggest_fling_v = 0.6 * v + 0.4 * kb->suggest_fling_v;
+        }
+        kb->suggest_drag_last_x = (double)x;
+        kb->suggest_drag_last_time = time_ms;
+        kbd_scroll_suggestions(kb);
         return;
     }
 
-    if (kb->input_mode == KBD_INPUT_TAP) {
-        if (kb->predictor && kb->input_moved && y >= kb->suggest_height) {
-            kb->input_mode = KBD_INPUT_SWIPE;
-            kb->preview_key = NULL;
-            kbd_draw_layout(kb);
-            kb->swipe_points[0] = (struct wvkbd_point){.x = kb->input_down_x,
-                                                      .y = kb->input_down_y,
-                                                      .time_ms = time_ms};
-            kb->swipe_points[1] = (struct wvkbd_point){
-                .x = x, .y = y, .time_ms = time_ms};
-            kb->swipe_points_len = 2;
-            kbd_update_suggestions_swipe(kb);
+    if (c->mode == KBD_INPUT_TAP) {
+        // only a lone finger swipes: a thumb rolling over another one while
+        // typing fast still taps
+        if (kb->predictor && c->moved && y >= kb->suggest_height &&
+            kbd_contacts_down(kb) == 1) {
+            c->mode = KBD_INPUT_SWIPE;
+            kbd_preview_set_key(kb, NULL);
+            kbd_swipe_begin(kb, c, time_ms, x, y);
             return;
         }
 
-        struct key *k = kbd_get_key(kb, x, y);
-        kbd_preview_set_key(kb, k);
+        c->key = kbd_get_key(kb, x, y);
+        // an older finger still held moves its key, not the preview
+        if (kbd_newest_tap(kb) == c) {
+            kbd_preview_set_key(kb, c->key);
+        }
+        return;
+    }
+
+    if (c->mode == KBD_INPUT_SWIPE) {
+        kbd_swipe_feed(kb, time_ms, x, y);
+        return;
+    }
+}
+
+/* A sample superseded by a later one of the same input frame: only the swipe
+ * path needs it, the rest runs once per frame through kbd_input_motion */
+void
+kbd_input_sample(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+                 uint32_t y)
+{
+    struct kbd_contact *c = kb ? kbd_contact_find(kb, id) : NULL;
+    if (!c || c->mode != KBD_INPUT_SWIPE) {
         return;
     }
+    kbd_swipe_push(kb, time_ms, x, y);
+}
 
-    if (kb->input_mode == KBD_INPUT_SWIPE) {
-        if (kb->swipe_points_len < WVKBD_MAX_SWIPE_POINTS) {
-            kb->swipe_points[kb->swipe_points_len++] =
-                (struct wvkbd_point){.x = x, .y = y, .time_ms = time_ms};
+/* Commit the key of a tap: the one under its finger now, or the last one it
+ * was on if it slid off the keys */
+static void
+kbd_tap_commit(struct kbd *kb, struct kbd_contact *c, uint32_t time_ms)
+{
+    uint32_t x = (uint32_t)(c->last_x < 0 ? 0 : c->last_x);
+    uint32_t y = (uint32_t)(c->last_y < 0 ? 0 : c->last_y);
+    struct key *k = kbd_get_key(kb, x, y);
+    if (!k) {
+        k = c->key;
+    }
+    c->mode = KBD_INPUT_NONE;
+    struct kbd_contact *newest = kbd_newest_tap(kb);
+    kbd_preview_set_key(kb, newest ? newest->key : NULL);
+
+    if (k) {
+        uint8_t mods_before = kb->mods;
+        bool is_sep = kbd_key_is_separator(kb, k, mods_before);
+        bool did_autocommit = false;
+        if (!is_sep &&
+            (kb->pending_swipe ||
+             kb->suggest_mode == WVKBD_SMODE_SWIPE)) {
+            kb->pending_swipe = false;
+            kb->pending_swipe_word[0] = '\0';
+            kb->swipe_points_len = 0;
+            kb->suggestions_len = 0;
+            kb->suggest_mode = WVKBD_SMODE_NONE;
+            kb->suggest_scroll_x = 0.0;
+        }
+
+        if (is_sep &&
+            (kb->pending_swipe ||
+             kb->suggest_mode == WVKBD_SMODE_SWIPE)) {
+            const char *w = kb->pending_swipe
+                                ? kb->pending_swipe_word
+                                : kbd_top_word_suggestion(kb);
+            if (w && w[0]) {
+                kbd_commit_suggestion(kb, time_ms, w);
+                did_autocommit = true;
+            }
         }
-        if ((time_ms - kb->swipe_last_suggest_time) > 40) {
-            kb->swipe_last_suggest_time = time_ms;
-            kbd_update_suggestions_swipe(kb);
+
+        uint32_t key_time = time_ms;
+        if (did_autocommit) {
+            key_time += 32;
         }
-        return;
+        kbd_press_key(kb, k, key_time);
+        kbd_release_key(kb, key_time);
+        kbd_handle_committed_key(kb, k, mods_before);
     }
+    kbd_draw_suggestion_bar(kb);
 }
 
 void
-kbd_input_up(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
+kbd_input_up(struct kbd *kb, int32_t id, uint32_t time_ms)
 {
-    if (!kb) {
+    struct kbd_contact *c = kb ? kbd_contact_find(kb, id) : NULL;
+    if (!c) {
         return;
     }
-    kb->input_down = false;
+    c->down = false;
+    uint32_t x = (uint32_t)(c->last_x < 0 ? 0 : c->last_x);
+    uint32_t y = (uint32_t)(c->last_y < 0 ? 0 : c->last_y);
 
-    if (kb->input_mode == KBD_INPUT_SUGGEST_SCROLL) {
-        if (!kb->input_moved) {
+    if (c->mode == KBD_INPUT_SUGGEST_SCROLL) {
+        // keep gliding if the finger was still moving when lifted
+        if (!c->moved || time_ms - kb->suggest_drag_last_time > 50 ||
+            fabs(kb->suggest_fling_v) < KBD_FLING_MIN_VELOCITY * 10) {
+            kb->suggest_fling_v = 0;
+        }
+        kb->suggest_fling_last_ms = 0;
+        kbd_schedule_animation(kb);
+        if (!c->moved) {
             int idx = -1;
             bool trash = false;
             bool cancel = false;
@@ -1793,8 +2917,11 @@ kbd_input_up(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
                     const char *word = kbd_suggestion_word(s);
                     if (trash && s->kind == WVKBD_SUGGEST_WORD) {
                         if (kb->predictor) {
-                            if (!wvkbd_predictor_remove_user_word(kb->predictor,
-                                                                 word)) {
+                            kbd_predictor_lock(kb);
+                            bool removed = wvkbd_predictor_remove_user_word(
+                                kb->predictor, word);
+                            kbd_predictor_unlock(kb);
+                            if (!removed) {
                                 kbd_dismiss_word(kb, word);
                             }
                         } else {
@@ -1803,8 +2930,10 @@ kbd_input_up(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
                         kbd_refresh_suggestions(kb);
                     } else if (s->kind == WVKBD_SUGGEST_ADD_WORD) {
                         if (kb->predictor) {
+                            kbd_predictor_lock(kb);
                             wvkbd_predictor_add_user_word(kb->predictor,
                                                           kb->current_token);
+                            kbd_predictor_unlock(kb);
                         }
                         kbd_update_suggestions_prefix(kb);
                     } else {
@@ -1813,67 +2942,86 @@ kbd_input_up(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y)
                 }
             }
         }
-        kb->input_mode = KBD_INPUT_NONE;
+        c->mode = KBD_INPUT_NONE;
         return;
     }
 
-    if (kb->input_mode == KBD_INPUT_TAP) {
-        struct key *k = kbd_get_key(kb, x, y);
-        if (!k) {
-            k = kb->preview_key;
-        }
-        kb->preview_key = NULL;
-
-        if (k) {
-            uint8_t mods_before = kb->mods;
-            bool is_sep = kbd_key_is_separator(kb, k, mods_before);
-            bool did_autocommit = false;
-            if (!is_sep &&
-                (kb->pending_swipe ||
-                 kb->suggest_mode == WVKBD_SMODE_SWIPE)) {
-                kb->pending_swipe = false;
-                kb->pending_swipe_word[0] = '\0';
-                kb->swipe_points_len = 0;
-                kb->suggestions_len = 0;
-                kb->suggest_mode = WVKBD_SMODE_NONE;
-                kb->suggest_scroll_x = 0.0;
-            }
-
-            if (is_sep &&
-                (kb->pending_swipe ||
-                 kb->suggest_mode == WVKBD_SMODE_SWIPE)) {
-                const char *w = kb->pending_swipe
-                                    ? kb->pending_swipe_word
-                                    : kbd_top_word_suggestion(kb);
-                if (w && w[0]) {
-                    kbd_commit_suggestion(kb, time_ms, w);
-                    did_autocommit = true;
-                }
-            }
-
-            uint32_t key_time = time_ms;
-            if (did_autocommit) {
-                key_time += 32;
-            }
-            kbd_press_key(kb, k, key_time);
-            kbd_release_key(kb, key_time);
-            kbd_handle_committed_key(kb, k, mods_before);
+    if (c->mode == KBD_INPUT_TAP) {
+        // fingers that went down before this one and are still held type
+        // first, so rolling over keys keeps their order
+        struct kbd_contact *o;
+        while ((o = kbd_oldest_tap(kb, c->seq))) {
+            kbd_tap_commit(kb, o, time_ms);
         }
-        kbd_draw_layout(kb);
-        kb->input_mode = KBD_INPUT_NONE;
+        kbd_tap_commit(kb, c, time_ms);
         return;
     }
 
-    if (kb->input_mode == KBD_INPUT_SWIPE) {
+    if (c->mode == KBD_INPUT_SWIPE) {
         // Compute final suggestions and cache the current best. Commit happens
         // on suggestion tap, or implicitly on the next separator (space/punct).
-        kbd_update_suggestions_swipe(kb);
-        kbd_set_pending_swipe_from_suggestions(kb);
-        kb->input_mode = KBD_INPUT_NONE;
+        kbd_swipe_finish(kb);
+        c->mode = KBD_INPUT_NONE;
+        return;
+    }
+
+    c->mode = KBD_INPUT_NONE;
+}
+
+/* The gesture is gone: drop its decode in flight, its path, its trail and
+ * the suggestions it brought up */
+static void
+kbd_input_drop_swipe(struct kbd *kb)
+{
+    kb->swipe_seq++;
+    struct kbd_swipe_worker *w = kb->swipe_worker;
+    if (w) {
+        pthread_mutex_lock(&w->lock);
+        w->req_pending = false;
+        pthread_mutex_unlock(&w->lock);
+    }
+    kb->trail_dirty = false;
+    kbd_cancel_swipe(kb);
+}
+
+void
+kbd_input_cancel(struct kbd *kb)
+{
+    bool swiping = kbd_contact_in_mode(kb, KBD_INPUT_SWIPE) != NULL;
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        kb->contacts[i].down = false;
+        kb->contacts[i].mode = KBD_INPUT_NONE;
+    }
+    kb->preview_key = NULL;
+    kb->trail_dirty = false;
+
+    if (swiping) {
+        kbd_input_drop_swipe(kb);
+    } else {
+        kb->swipe_points_len = 0;
+        kbd_draw_trail(kb);
+    }
+    kbd_schedule_layout(kb);
+}
+
+/* Drop a single contact without committing it, the others stay held */
+void
+kbd_input_cancel_contact(struct kbd *kb, int32_t id)
+{
+    struct kbd_contact *c = kb ? kbd_contact_find(kb, id) : NULL;
+    if (!c) {
         return;
     }
+    bool swiping = c->mode == KBD_INPUT_SWIPE;
+    c->down = false;
+    c->mode = KBD_INPUT_NONE;
 
-    kb->input_mode = KBD_INPUT_NONE;
+    struct kbd_contact *newest = kbd_newest_tap(kb);
+    kbd_preview_set_key(kb, newest ? newest->key : NULL);
+    if (swiping) {
+        kbd_input_drop_swipe(kb);
+        kbd_schedule_layout(kb);
+    }
 }
 
 void
@@ -1891,6 +3039,60 @@ draw_over_inset(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t width,
                        height - (border * 2), rounding);
 }
 
+static struct kbd_keymap *
+kbd_keymap_lookup(struct kbd *kb, int keymap_index, uint32_t comp_unichr,
+                  uint32_t comp_shift_unichr)
+{
+    struct kbd_keymap *victim = &kb->keymap_cache[0];
+    for (int i = 0; i < WVKBD_KEYMAP_CACHE_SIZE; i++) {
+        struct kbd_keymap *km = &kb->keymap_cache[i];
+        if (km->size && km->index == keymap_index &&
+            km->comp_unichr == comp_unichr &&
+            km->comp_shift_unichr == comp_shift_unichr) {
+            km->last_used = ++kb->keymap_clock;
+            return km;
+        }
+        if (!km->size) {
+            victim = km;
+        } else if (victim->size && km->last_used < victim->last_used) {
+            victim = km;
+        }
+    }
+
+    // not cached yet: format the template into the least recently used slot
+    const char *keymap_template = keymaps[keymap_index];
+    size_t keymap_size = strlen(keymap_template) + 64;
+    char *keymap_str = malloc(keymap_size);
+    if (!keymap_str) {
+        die("could not allocate keymap\n");
+    }
+    snprintf(keymap_str, keymap_size, keymap_template, comp_unichr,
+             comp_shift_unichr);
+    keymap_size = strlen(keymap_str) + 1;
+    int keymap_fd = os_create_sealed_file(keymap_str, keymap_size);
+    free(keymap_str);
+    if (keymap_fd < 0) {
+        die("could not create keymap fd\n");
+    }
+
+    if (victim->size) {
+        if (kb->debug)
+            fprintf(stderr, "Evicting keymap %s U%04X/U%04X\n",
+                    keymap_names[victim->index], victim->comp_unichr,
+                    victim->comp_shift_unichr);
+        close(victim->fd);
+        if (kb->keymap_current == victim)
+            kb->keymap_current = NULL;
+    }
+    victim->index = keymap_index;
+    victim->comp_unichr = comp_unichr;
+    victim->comp_shift_unichr = comp_shift_unichr;
+    victim->fd = keymap_fd;
+    victim->size = keymap_size;
+    victim->last_used = ++kb->keymap_clock;
+    return victim;
+}
+
 void
 create_and_upload_keymap(struct kbd *kb, const char *name, uint32_t comp_unichr,
                          uint32_t comp_shift_unichr)
@@ -1905,25 +3107,15 @@ create_and_upload_keymap(struct kbd *kb, const char *name, uint32_t comp_unichr,
         fprintf(stderr, "No such keymap defined: %s\n", name);
         exit(9);
     }
-    const char *keymap_template = keymaps[keymap_index];
-    size_t keymap_size = strlen(keymap_template) + 64;
-    char *keymap_str = malloc(keymap_size);
-    sprintf(keymap_str, keymap_template, comp_unichr, comp_shift_unichr);
-    keymap_size = strlen(keymap_str);
-    int keymap_fd = os_create_anonymous_file(keymap_size);
-    if (keymap_fd < 0) {
-        die("could not create keymap fd\n");
-    }
-    void *ptr = mmap(NULL, keymap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     keymap_fd, 0);
-    if (ptr == (void *)-1) {
-        die("could not map keymap data\n");
-    }
-    if (kb->vkbd == NULL) {
+    if (kb->vkbd == NULL && kb->recorder == NULL) {
         die("kb.vkbd = NULL\n");
     }
-    strcpy(ptr, keymap_str);
-    zwp_virtual_keyboard_v1_keymap(kb->vkbd, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-                                   keymap_fd, keymap_size);
-    free((void *)keymap_str);
+    struct kbd_keymap *km =
+        kbd_keymap_lookup(kb, keymap_index, comp_unichr, comp_shift_unichr);
+    if (km == kb->keymap_current) {
+        // the compositor already has this exact keymap
+        return;
+    }
+    kbd_send_keymap(kb, km->fd, km->size);
+    kb->keymap_current = km;
 }
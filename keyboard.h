@@ -1,6 +1,8 @@
 #ifndef __KEYBOARD_H
 #define __KEYBOARD_H
 
+#include <stdio.h>
+
 #include "drw.h"
 #include "predict.h"
 
@@ -10,7 +12,25 @@
 #define WVKBD_MAX_TOKEN_BYTES 128
 #define WVKBD_MAX_CONTEXT_WORDS 64
 #define WVKBD_MAX_SWIPE_POINTS 192
+#define KBD_SWIPE_TAIL_POINTS 16 // never simplified away, see kbd_swipe_simplify()
+/* mid-swipe suggestion refresh: bounds of the interval, and the weight of the
+ * latest decode in the running average of its duration */
+#define KBD_SWIPE_INTERVAL_MIN_MS 16
+#define KBD_SWIPE_INTERVAL_MAX_MS 250
+#define KBD_SWIPE_COST_WEIGHT 0.25
 #define WVKBD_MAX_DISMISSED_WORDS 256
+#define WVKBD_KEYMAP_CACHE_SIZE 8
+#define WVKBD_MAX_SCRATCH_KEYS 128
+#define WVKBD_LAYOUT_CACHE_SIZE 4
+#define KBD_MAX_CONTACTS 10
+#define KBD_MAX_CROSSED_KEYS 64 // keys one -O motion segment may cross
+#define KBD_POINTER_CONTACT -1 // id of the pointer among touch points
+
+#define KBD_SUGGEST_PAD_X 8
+#define KBD_SUGGEST_PAD_Y 6
+/* suggestion bar fling: velocity kept per ms, and the speed it stops at */
+#define KBD_FLING_FRICTION 0.996
+#define KBD_FLING_MIN_VELOCITY 0.02
 
 enum key_type;
 enum key_modifier_type;
@@ -19,6 +39,7 @@ struct key;
 struct layout;
 struct kbd;
 struct wvkbd_predictor;
+struct kbd_swipe_worker;
 
 enum key_type {
 	Pad = 0, // Padding, not a pressable key
@@ -95,6 +116,11 @@ struct layout {
 	const char *name;
 	bool abc; //is this an alphabetical/abjad layout or not? (i.e. something that is a primary input layout)
 	uint32_t keyheight; // absolute height (pixels)
+
+	// row lookup for hit testing, computed by kbd_init_layout
+	struct key **rows;  // first key of every row
+	uint8_t rows_len;
+	uint32_t y_offset;  // top of the first row (pixels)
 };
 
 enum kbd_input_mode {
@@ -104,6 +130,20 @@ enum kbd_input_mode {
 	KBD_INPUT_SUGGEST_SCROLL,
 };
 
+/* One touch point, or the pointer, from down to up. Each decides for itself
+ * whether it taps, swipes or scrolls the suggestions */
+struct kbd_contact {
+	int32_t id;
+	bool down;
+	enum kbd_input_mode mode;
+	uint32_t seq; // order of touch down, taps are committed in it
+	uint32_t down_time;
+	int down_x, down_y;
+	int last_x, last_y;
+	bool moved;
+	struct key *key; // key a tap commits if released off the keyboard
+};
+
 enum wvkbd_suggestion_kind {
 	WVKBD_SUGGEST_WORD = 0,
 	WVKBD_SUGGEST_ADD_WORD,
@@ -123,6 +163,33 @@ struct wvkbd_suggestion {
 	int score;                     // debugging / ordering only
 };
 
+/* Counts what would have been sent to the virtual keyboard, and logs it if
+ * log is set. Used instead of one to run without a compositor */
+struct kbd_recorder {
+	uint32_t keys;
+	uint32_t modifiers;
+	uint32_t keymaps;
+	FILE *log;
+};
+
+/* A formatted keymap, kept around so it can be re-sent without rebuilding */
+struct kbd_keymap {
+	int index;                 // index into keymap_names[]
+	uint32_t comp_unichr;      // codepoints substituted into the template
+	uint32_t comp_shift_unichr;
+	int fd;                    // sealed file holding the keymap text
+	size_t size;               // 0 marks an unused slot
+	uint32_t last_used;        // LRU stamp
+};
+
+/* The key area of a layout as drawn with no keys pressed */
+struct kbd_layout_image {
+	struct layout *layout;
+	uint8_t mods;              // Shift/CapsLock, the mods that change labels
+	uint32_t last_used;        // LRU stamp
+	cairo_surface_t *surf;
+};
+
 struct kbd {
 	bool debug;
 
@@ -141,6 +208,9 @@ struct kbd {
 	uint8_t compose;
 	struct key *last_press;
 	struct key *last_swipe;
+	/* previous sample of a -O swipe, keys are reported along the segment */
+	int intersect_x, intersect_y;
+	bool intersect_tracking;
 	struct key *preview_key;
 	struct layout *prevlayout; //the previous layout, needed to keep track of keymap changes
 	size_t layer_index;
@@ -154,7 +224,18 @@ struct kbd {
 
 	struct drwsurf *surf;
 	struct drwsurf *popup_surf;
+	/* a full redraw is due at the next frame, see kbd_schedule_layout() */
+	bool dirty_layout;
+	/* overlay above surf holding only the swipe trail, if available */
+	struct drwsurf *trail_surf;
+	struct kbd_layout_image layout_images[WVKBD_LAYOUT_CACHE_SIZE];
+	uint32_t layout_image_clock;
 	struct zwp_virtual_keyboard_v1 *vkbd;
+	struct kbd_recorder *recorder; // replaces vkbd when running headless
+
+	struct kbd_keymap keymap_cache[WVKBD_KEYMAP_CACHE_SIZE];
+	struct kbd_keymap *keymap_current; // last keymap sent to the compositor
+	uint32_t keymap_clock;
 
 	uint32_t last_popup_x, last_popup_y, last_popup_w, last_popup_h;
 
@@ -173,6 +254,12 @@ struct kbd {
 	uint32_t suggest_cancel_y;
 	uint32_t suggest_cancel_w;
 	uint32_t suggest_cancel_h;
+	uint32_t suggest_reserved_left;
+	/* pills rendered once at suggest_pill_cx, blitted while scrolling */
+	struct drwsurf suggest_strip;
+	struct drwbuf suggest_strip_buf;
+	bool suggest_strip_valid;
+	double suggest_pill_cx[WVKBD_MAX_SUGGESTIONS];
 
 	/* token + context */
 	char current_token[WVKBD_MAX_TOKEN_BYTES];
@@ -183,22 +270,31 @@ struct kbd {
 	int context_words_max;
 
 	/* input tracking */
-	bool input_down;
-	enum kbd_input_mode input_mode;
-	uint32_t input_down_time;
-	int input_down_x, input_down_y;
-	int input_last_x, input_last_y;
-	bool input_moved;
+	struct kbd_contact contacts[KBD_MAX_CONTACTS];
+	uint32_t contact_seq;
 
 	/* suggestion bar drag */
 	double suggest_drag_start_x;
 	double suggest_drag_start_scroll_x;
+	double suggest_drag_last_x;
+	uint32_t suggest_drag_last_time;
+	double suggest_fling_v; /* scroll px per ms */
+	uint64_t suggest_fling_last_ms;
 
 	/* swipe */
 	uint32_t swipe_threshold_px;
 	struct wvkbd_point swipe_points[WVKBD_MAX_SWIPE_POINTS];
+	/* path length from the first point up to each point */
+	double swipe_dist[WVKBD_MAX_SWIPE_POINTS];
 	int swipe_points_len;
+	int swipe_points_total; // pushed this gesture, simplified away or not
 	uint32_t swipe_last_suggest_time;
+	int swipe_budget; // share of the time the decoder may run, percent
+	double swipe_cost_ms; // running average of wvkbd_predict_swipe
+	uint32_t swipe_interval_ms;
+	/* per-gesture decoder state, see kbd_swipe_begin() */
+	struct wvkbd_key_pos_map swipe_pos;
+	int swipe_decoded_total;
 	bool pending_swipe;
 	char pending_swipe_word[WVKBD_MAX_TOKEN_BYTES];
 	char dismissed_words[WVKBD_MAX_DISMISSED_WORDS][WVKBD_MAX_TOKEN_BYTES];
@@ -211,11 +307,18 @@ struct kbd {
 	double trail_width_px;
 	Color trail_color;
 	uint32_t trail_now_ms;
+	/* new points to show even if the trail had faded out */
+	bool trail_dirty;
+	/* duration of one output frame */
+	uint32_t frame_ms;
 	uint32_t trail_last_input_ms;
 	uint64_t trail_last_mono_ms;
+	uint32_t trail_x, trail_y, trail_w, trail_h; // area of the last drawn trail
 
 	/* predictor */
 	struct wvkbd_predictor *predictor;
+	struct kbd_swipe_worker *swipe_worker; // NULL when decoding inline
+	uint32_t swipe_seq; // id of the latest swipe decode request
 };
 
 void draw_inset(struct drwsurf *ds, uint32_t x, uint32_t y, uint32_t width,
@@ -237,6 +340,9 @@ void kbd_print_key_stdout(struct kbd *kb, struct key *k);
 void kbd_clear_last_popup(struct kbd *kb);
 void kbd_draw_key(struct kbd *kb, struct key *k, enum key_draw_type);
 void kbd_draw_layout(struct kbd *kb);
+void kbd_flush_layout_images(struct kbd *kb);
+void kbd_schedule_layout(struct kbd *kb);
+void kbd_draw_trail(struct kbd *kb);
 void kbd_resize(struct kbd *kb, struct layout *layouts, uint8_t layoutcount);
 uint8_t kbd_get_rows(struct layout *l);
 double kbd_get_row_length(struct key *k);
@@ -245,10 +351,22 @@ void kbd_switch_layout(struct kbd *kb, struct layout *l, size_t layer_index);
 
 void kbd_set_suggest_height(struct kbd *kb, uint32_t suggest_height);
 void kbd_set_predictor(struct kbd *kb, struct wvkbd_predictor *predictor);
-
-void kbd_input_down(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y);
-void kbd_input_motion(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y);
-void kbd_input_up(struct kbd *kb, uint32_t time_ms, uint32_t x, uint32_t y);
+int kbd_swipe_worker_start(struct kbd *kb);
+void kbd_swipe_worker_stop(struct kbd *kb);
+void kbd_swipe_worker_dispatch(struct kbd *kb);
+
+void kbd_input_down(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+                    uint32_t y);
+void kbd_input_motion(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+                      uint32_t y);
+void kbd_input_sample(struct kbd *kb, int32_t id, uint32_t time_ms, uint32_t x,
+                      uint32_t y);
+void kbd_input_up(struct kbd *kb, int32_t id, uint32_t time_ms);
+void kbd_input_cancel(struct kbd *kb);
+void kbd_input_cancel_contact(struct kbd *kb, int32_t id);
+
+uint64_t kbd_monotonic_ms(void);
+void kbd_set_refresh(struct kbd *kb, int32_t refresh_mhz);
 
 void create_and_upload_keymap(struct kbd *kb, const char *name,
                               uint32_t comp_unichr, uint32_t comp_shift_unichr);
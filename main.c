@@ -10,7 +10,6 @@
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
-#include <sys/timerfd.h>
 #include <time.h>
 #include <poll.h>
 #include <unistd.h>
@@ -19,6 +18,7 @@
 #include <wchar.h>
 
 #include "keyboard.h"
+#include "shm_open.h"
 #include "config.h"
 
 /* lazy die macro */
@@ -33,6 +33,8 @@
 static const char *namespace = "wvkbd";
 static struct wl_display *display;
 static struct wl_compositor *compositor;
+static struct wl_subcompositor *subcompositor;
+static struct wl_subsurface *trail_subsurface;
 static struct wl_seat *seat;
 static struct wl_pointer *pointer;
 static struct wl_touch *touch;
@@ -46,7 +48,8 @@ static struct xdg_positioner *popup_xdg_positioner;
 static struct zwp_virtual_keyboard_manager_v1 *vkbd_mgr;
 static struct wp_fractional_scale_v1 *wfs_draw_surf;
 static struct wp_fractional_scale_manager_v1 *wfs_mgr;
-static struct wp_viewport *draw_surf_viewport, *popup_draw_surf_viewport;
+static struct wp_viewport *draw_surf_viewport, *popup_draw_surf_viewport,
+    *trail_draw_surf_viewport;
 static struct wp_viewporter *viewporter;
 static bool popup_xdg_surface_configured;
 
@@ -54,6 +57,7 @@ struct Output {
     uint32_t name;
     uint32_t w, h;
     double scale;
+    int32_t refresh; /* mHz, 0 if unknown */
     struct wl_output *data;
 };
 static struct Output *current_output;
@@ -65,7 +69,8 @@ static int wl_outputs_size;
 /* drawing */
 static struct drw draw_ctx;
 static struct drwbuf draw_surf_back_buffer, draw_surf_display_buffer, popup_draw_surf_back_buffer, popup_draw_surf_display_buffer;
-static struct drwsurf draw_surf, popup_draw_surf;
+static struct drwbuf trail_draw_surf_back_buffer, trail_draw_surf_display_buffer;
+static struct drwsurf draw_surf, popup_draw_surf, trail_draw_surf;
 
 /* layer surface parameters */
 static uint32_t layer = ZWLR_LAYER_SHELL_V1_LAYER_OVERLAY;
@@ -84,23 +89,20 @@ static bool hidden = false;
 
 static struct wvkbd_predictor predictor;
 static bool predictor_initialized;
-static bool trail_timer_armed;
 
-static uint64_t
-mono_now_ms(void)
-{
-    struct timespec ts = {0};
-    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-        return 0;
-    }
-    return ((uint64_t)ts.tv_sec * 1000ULL) + ((uint64_t)ts.tv_nsec / 1000000ULL);
-}
+/* last motion of each touch point, applied when its wl_touch.frame arrives */
+struct touch_motion {
+    int32_t id;
+    bool pending;
+    uint32_t time, x, y;
+};
+static struct touch_motion touch_motions[KBD_MAX_CONTACTS];
 
 static void
 update_trail_clock(uint32_t time_ms)
 {
     keyboard.trail_last_input_ms = time_ms;
-    keyboard.trail_last_mono_ms = mono_now_ms();
+    keyboard.trail_last_mono_ms = kbd_monotonic_ms();
     keyboard.trail_now_ms = time_ms;
 }
 
@@ -176,6 +178,8 @@ static void layer_surface_closed(void *data,
                                  struct zwlr_layer_surface_v1 *surface);
 static void flip_landscape();
 static void show();
+static void trail_surface_create();
+static void trail_surface_destroy();
 
 /* event handlers */
 static const struct wl_pointer_listener pointer_listener = {
@@ -231,6 +235,26 @@ estrdup(const char *s)
     return p;
 }
 
+static void
+touch_flush_motion()
+{
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++) {
+        struct touch_motion *m = &touch_motions[i];
+        if (!m->pending) {
+            continue;
+        }
+        m->pending = false;
+
+        if (keyboard.print_intersect) {
+            kbd_motion_key(&keyboard, m->time, m->x, m->y);
+            continue;
+        }
+
+        update_trail_clock(m->time);
+        kbd_input_motion(&keyboard, m->id, m->time, m->x, m->y);
+    }
+}
+
 void
 wl_touch_down(void *data, struct wl_touch *wl_touch, uint32_t serial,
               uint32_t time, struct wl_surface *surface, int32_t id,
@@ -246,6 +270,9 @@ wl_touch_down(void *data, struct wl_touch *wl_touch, uint32_t serial,
     if (keyboard.print_intersect) {
         struct key *next_key;
         kbd_unpress_key(&keyboard, time);
+        keyboard.intersect_x = touch_x;
+        keyboard.intersect_y = touch_y;
+        keyboard.intersect_tracking = true;
         next_key = kbd_get_key(&keyboard, touch_x, touch_y);
         if (next_key) {
             kbd_press_key(&keyboard, next_key, time);
@@ -258,7 +285,7 @@ wl_touch_down(void *data, struct wl_touch *wl_touch, uint32_t serial,
     }
 
     update_trail_clock(time);
-    kbd_input_down(&keyboard, time, touch_x, touch_y);
+    kbd_input_down(&keyboard, id, time, touch_x, touch_y);
 }
 
 void
@@ -269,15 +296,15 @@ wl_touch_up(void *data, struct wl_touch *wl_touch, uint32_t serial,
         return;
     }
 
+    touch_flush_motion();
+
     if (keyboard.print_intersect) {
         kbd_release_key(&keyboard, time);
         return;
     }
 
     update_trail_clock(time);
-    uint32_t last_x = (uint32_t)(keyboard.input_last_x < 0 ? 0 : keyboard.input_last_x);
-    uint32_t last_y = (uint32_t)(keyboard.input_last_y < 0 ? 0 : keyboard.input_last_y);
-    kbd_input_up(&keyboard, time, last_x, last_y);
+    kbd_input_up(&keyboard, id, time);
 }
 
 void
@@ -288,26 +315,45 @@ wl_touch_motion(void *data, struct wl_touch *wl_touch, uint32_t time,
         return;
     }
 
-    uint32_t touch_x = wl_fixed_to_int(x);
-    uint32_t touch_y = wl_fixed_to_int(y);
-
-    if (keyboard.print_intersect) {
-        kbd_motion_key(&keyboard, time, touch_x, touch_y);
-        return;
+    struct touch_motion *m = NULL;
+    for (int i = 0; i < KBD_MAX_CONTACTS && !m; i++) {
+        if (touch_motions[i].pending && touch_motions[i].id == id)
+            m = &touch_motions[i];
     }
-
-    update_trail_clock(time);
-    kbd_input_motion(&keyboard, time, touch_x, touch_y);
+    if (m) {
+        // an earlier motion of this frame is only kept for the swipe path
+        if (!keyboard.print_intersect)
+            kbd_input_sample(&keyboard, id, m->time, m->x, m->y);
+    } else {
+        for (int i = 0; i < KBD_MAX_CONTACTS && !m; i++) {
+            if (!touch_motions[i].pending)
+                m = &touch_motions[i];
+        }
+        if (!m) {
+            touch_flush_motion();
+            m = &touch_motions[0];
+        }
+    }
+    m->id = id;
+    m->pending = true;
+    m->time = time;
+    m->x = wl_fixed_to_int(x);
+    m->y = wl_fixed_to_int(y);
 }
 
 void
 wl_touch_frame(void *data, struct wl_touch *wl_touch)
 {
+    touch_flush_motion();
 }
 
 void
 wl_touch_cancel(void *data, struct wl_touch *wl_touch)
 {
+    for (int i = 0; i < KBD_MAX_CONTACTS; i++)
+        touch_motions[i].pending = false;
+    if (!keyboard.print_intersect)
+        kbd_input_cancel(&keyboard);
 }
 
 void
@@ -336,10 +382,7 @@ wl_pointer_leave(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
     cur_x = cur_y = -1;
     if (cur_press && !keyboard.print_intersect) {
         cur_press = false;
-        keyboard.input_down = false;
-        keyboard.input_mode = KBD_INPUT_NONE;
-        keyboard.preview_key = NULL;
-        kbd_draw_layout(&keyboard);
+        kbd_input_cancel_contact(&keyboard, KBD_POINTER_CONTACT);
     }
 }
 
@@ -359,7 +402,8 @@ wl_pointer_motion(void *data, struct wl_pointer *wl_pointer, uint32_t time,
             kbd_motion_key(&keyboard, time, cur_x, cur_y);
         } else {
             update_trail_clock(time);
-            kbd_input_motion(&keyboard, time, (uint32_t)cur_x, (uint32_t)cur_y);
+            kbd_input_motion(&keyboard, KBD_POINTER_CONTACT, time,
+                             (uint32_t)cur_x, (uint32_t)cur_y);
         }
     }
 }
@@ -382,6 +426,9 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
             kbd_release_key(&keyboard, time);
         }
         if (cur_press && cur_x >= 0 && cur_y >= 0) {
+            keyboard.intersect_x = cur_x;
+            keyboard.intersect_y = cur_y;
+            keyboard.intersect_tracking = true;
             next_key = kbd_get_key(&keyboard, cur_x, cur_y);
             if (next_key) {
                 kbd_press_key(&keyboard, next_key, time);
@@ -396,12 +443,11 @@ wl_pointer_button(void *data, struct wl_pointer *wl_pointer, uint32_t serial,
 
     if (cur_press && cur_x >= 0 && cur_y >= 0) {
         update_trail_clock(time);
-        kbd_input_down(&keyboard, time, (uint32_t)cur_x, (uint32_t)cur_y);
+        kbd_input_down(&keyboard, KBD_POINTER_CONTACT, time, (uint32_t)cur_x,
+                       (uint32_t)cur_y);
     } else if (!cur_press) {
         update_trail_clock(time);
-        uint32_t last_x = (uint32_t)(keyboard.input_last_x < 0 ? 0 : keyboard.input_last_x);
-        uint32_t last_y = (uint32_t)(keyboard.input_last_y < 0 ? 0 : keyboard.input_last_y);
-        kbd_input_up(&keyboard, time, last_x, last_y);
+        kbd_input_up(&keyboard, KBD_POINTER_CONTACT, time);
     }
 }
 
@@ -464,6 +510,7 @@ wl_surface_enter(void *data, struct wl_surface *wl_surface,
         return;
     }
 
+    kbd_set_refresh(&keyboard, current_output->refresh);
     keyboard.preferred_scale = current_output->scale;
     flip_landscape();
 }
@@ -517,6 +564,15 @@ static void
 display_handle_mode(void *data, struct wl_output *wl_output, uint32_t flags,
                     int width, int height, int refresh)
 {
+    struct Output *output = data;
+    if (!(flags & WL_OUTPUT_MODE_CURRENT)) {
+        return;
+    }
+    output->refresh = refresh;
+
+    if (current_output == output) {
+        kbd_set_refresh(&keyboard, refresh);
+    }
 }
 
 static const struct wl_output_listener output_listener = {
@@ -542,6 +598,9 @@ handle_global(void *data, struct wl_registry *registry, uint32_t name,
     if (strcmp(interface, wl_compositor_interface.name) == 0) {
         compositor =
             wl_registry_bind(registry, name, &wl_compositor_interface, 3);
+    } else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
+        subcompositor =
+            wl_registry_bind(registry, name, &wl_subcompositor_interface, 1);
     } else if (strcmp(interface, wl_shm_interface.name) == 0) {
         draw_ctx.shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
     } else if (strcmp(interface, wl_output_interface.name) == 0) {
@@ -674,6 +733,7 @@ flip_landscape()
             popup_draw_surf.surf = NULL;
         }
 
+        trail_surface_destroy();
         zwlr_layer_surface_v1_destroy(layer_surface);
         layer_surface = NULL;
         wl_surface_destroy(draw_surf.surf);
@@ -705,6 +765,15 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
         } else {
             wl_surface_set_buffer_scale(draw_surf.surf, keyboard.scale);
         }
+        if (trail_draw_surf.surf) {
+            if (trail_draw_surf_viewport) {
+                wp_viewport_set_destination(trail_draw_surf_viewport,
+                                            keyboard.w, keyboard.h);
+            } else {
+                wl_surface_set_buffer_scale(trail_draw_surf.surf,
+                                            keyboard.scale);
+            }
+        }
 
         if (popup_xdg_popup) {
             xdg_popup_destroy(popup_xdg_popup);
@@ -745,8 +814,18 @@ layer_surface_configure(void *data, struct zwlr_layer_surface_v1 *surface,
 
         zwlr_layer_surface_v1_ack_configure(surface, serial);
         kbd_resize(&keyboard, layouts, NumLayouts);
+        if (keyboard.trail_surf)
+            drwsurf_attach(&trail_draw_surf);
         drwsurf_attach(&draw_surf);
         keyboard.output = current_output;
+
+        if (keyboard.debug) {
+            struct shm_stats stats;
+            shm_get_stats(&stats);
+            fprintf(stderr, "shm: %zu bytes mapped, %lu allocations (%.2f/s)\n",
+                    stats.bytes_mapped, stats.allocations,
+                    stats.allocations_per_sec);
+        }
     } else {
         zwlr_layer_surface_v1_ack_configure(surface, serial);
     }
@@ -778,6 +857,7 @@ usage(char *argv0)
     fprintf(stderr, "  --suggest-height [int] - Suggestion bar height in pixels\n");
     fprintf(stderr, "  --suggestions [int]    - Number of suggestions to show\n");
     fprintf(stderr, "  --context-words [int]  - Context words to remember\n");
+    fprintf(stderr, "  --swipe-budget [int]   - Share of time spent decoding swipes (%%)\n");
     fprintf(stderr, "  --wordlist [path]      - Base wordlist path\n");
     fprintf(stderr, "  --user-words [path]    - User dictionary path\n");
     fprintf(stderr, "  --bigrams [path]       - Bigram counts file path\n");
@@ -824,6 +904,49 @@ list_layers()
     }
 }
 
+/* the swipe trail is drawn on a subsurface above the keys, so animating it
+ * never touches the key buffer */
+void
+trail_surface_create()
+{
+    if (!keyboard.trail_surf) {
+        return;
+    }
+
+    trail_draw_surf.surf = wl_compositor_create_surface(compositor);
+    wl_surface_set_input_region(trail_draw_surf.surf, empty_region);
+    trail_subsurface = wl_subcompositor_get_subsurface(
+        subcompositor, trail_draw_surf.surf, draw_surf.surf);
+    wl_subsurface_set_position(trail_subsurface, 0, 0);
+    wl_subsurface_set_desync(trail_subsurface);
+    if (wfs_mgr && viewporter) {
+        trail_draw_surf_viewport =
+            wp_viewporter_get_viewport(viewporter, trail_draw_surf.surf);
+    }
+}
+
+void
+trail_surface_destroy()
+{
+    if (!trail_draw_surf.surf) {
+        return;
+    }
+
+    if (trail_draw_surf.frame_cb) {
+        wl_callback_destroy(trail_draw_surf.frame_cb);
+        trail_draw_surf.frame_cb = NULL;
+    }
+    trail_draw_surf.attached = false;
+    if (trail_draw_surf_viewport) {
+        wp_viewport_destroy(trail_draw_surf_viewport);
+        trail_draw_surf_viewport = NULL;
+    }
+    wl_subsurface_destroy(trail_subsurface);
+    trail_subsurface = NULL;
+    wl_surface_destroy(trail_draw_surf.surf);
+    trail_draw_surf.surf = NULL;
+}
+
 void
 hide()
 {
@@ -840,6 +963,7 @@ hide()
         draw_surf_viewport = NULL;
     }
 
+    trail_surface_destroy();
     zwlr_layer_surface_v1_destroy(layer_surface);
     wl_surface_destroy(draw_surf.surf);
     layer_surface = NULL;
@@ -867,6 +991,7 @@ show()
         draw_surf_viewport =
             wp_viewporter_get_viewport(viewporter, draw_surf.surf);
     }
+    trail_surface_create();
 
     struct wl_output *current_output_data = NULL;
     if (current_output)
@@ -931,6 +1056,7 @@ main(int argc, char **argv)
     uint32_t suggest_height = KBD_SUGGEST_HEIGHT;
     int suggest_count = 3;
     int context_words = 5;
+    int swipe_budget = 50;
 
     bool trail_enabled = true;
     uint32_t trail_fade_ms = 800;
@@ -952,6 +1078,8 @@ main(int argc, char **argv)
         suggest_count = atoi(tmp);
     if ((tmp = getenv("WVKBD_CONTEXT_WORDS")))
         context_words = atoi(tmp);
+    if ((tmp = getenv("WVKBD_SWIPE_BUDGET")))
+        swipe_budget = atoi(tmp);
     if ((tmp = getenv("WVKBD_TRAIL_ENABLE")))
         trail_enabled = atoi(tmp) != 0;
     if ((tmp = getenv("WVKBD_TRAIL_FADE_MS")))
@@ -966,6 +1094,8 @@ main(int argc, char **argv)
         user_words_path = tmp;
     if ((tmp = getenv("WVKBD_BIGRAMS_PATH")))
         bigrams_path = tmp;
+    if ((tmp = getenv("WVKBD_SHM_HUGEPAGES")))
+        shm_set_hugepages(atoi(tmp) != 0);
 
     height = landscape_height = KBD_PIXEL_LANDSCAPE_HEIGHT + suggest_height;
     normal_height = KBD_PIXEL_HEIGHT + suggest_height;
@@ -986,6 +1116,7 @@ main(int argc, char **argv)
     keyboard.suggest_height = suggest_height;
     keyboard.suggest_visible_count = suggest_count;
     keyboard.context_words_max = context_words;
+    keyboard.swipe_budget = swipe_budget;
 
     uint8_t alpha = 0;
     bool alpha_defined = false;
@@ -1019,6 +1150,13 @@ main(int argc, char **argv)
             }
             context_words = atoi(argv[++i]);
             keyboard.context_words_max = context_words;
+        } else if (!strcmp(argv[i], "--swipe-budget")) {
+            if (i >= argc - 1) {
+                usage(argv[0]);
+                exit(1);
+            }
+            swipe_budget = atoi(argv[++i]);
+            keyboard.swipe_budget = swipe_budget;
         } else if (!strcmp(argv[i], "--wordlist")) {
             if (i >= argc - 1) {
                 usage(argv[0]);
@@ -1267,6 +1405,9 @@ main(int argc, char **argv)
     popup_draw_surf.ctx = &draw_ctx;
     popup_draw_surf.back_buffer = &popup_draw_surf_back_buffer;
     popup_draw_surf.display_buffer = &popup_draw_surf_display_buffer;
+    trail_draw_surf.ctx = &draw_ctx;
+    trail_draw_surf.back_buffer = &trail_draw_surf_back_buffer;
+    trail_draw_surf.display_buffer = &trail_draw_surf_display_buffer;
     keyboard.surf = &draw_surf;
     keyboard.popup_surf = &popup_draw_surf;
 
@@ -1289,6 +1430,10 @@ main(int argc, char **argv)
     if (vkbd_mgr == NULL) {
         die("virtual_keyboard_manager not available\n");
     }
+    // without a trail there is nothing to put on an overlay
+    if (subcompositor && trail_enabled) {
+        keyboard.trail_surf = &trail_draw_surf;
+    }
 
     // A second round-trip to receive wl_outputs events
     wl_display_roundtrip(display);
@@ -1326,10 +1471,10 @@ main(int argc, char **argv)
     struct pollfd fds[3];
     int WAYLAND_FD = 0;
     int SIGNAL_FD = 1;
-    int TIMER_FD = 2;
+    int SWIPE_FD = 2;
     fds[WAYLAND_FD].events = POLLIN;
     fds[SIGNAL_FD].events = POLLIN;
-    fds[TIMER_FD].events = POLLIN;
+    fds[SWIPE_FD].events = POLLIN;
 
     fds[WAYLAND_FD].fd = wl_display_get_fd(display);
     if (fds[WAYLAND_FD].fd == -1) {
@@ -1351,28 +1496,12 @@ main(int argc, char **argv)
         die("Failed to get signalfd: %d\n", errno);
     }
 
-    fds[TIMER_FD].fd =
-        timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
-    if (fds[TIMER_FD].fd == -1) {
-        die("Failed to create timerfd: %d\n", errno);
-    }
+    // a negative fd is ignored by poll(), swipes are then decoded inline
+    fds[SWIPE_FD].fd = kbd_swipe_worker_start(&keyboard);
 
     while (run_display) {
         wl_display_flush(display);
 
-        bool want_timer = keyboard.trail_enabled && keyboard.swipe_points_len >= 2;
-        if (want_timer && !trail_timer_armed) {
-            struct itimerspec its = {0};
-            its.it_interval.tv_nsec = 16 * 1000 * 1000;
-            its.it_value = its.it_interval;
-            timerfd_settime(fds[TIMER_FD].fd, 0, &its, NULL);
-            trail_timer_armed = true;
-        } else if (!want_timer && trail_timer_armed) {
-            struct itimerspec its = {0};
-            timerfd_settime(fds[TIMER_FD].fd, 0, &its, NULL);
-            trail_timer_armed = false;
-        }
-
         poll(fds, 3, -1);
 
         if (fds[WAYLAND_FD].revents & POLLIN)
@@ -1399,20 +1528,12 @@ main(int argc, char **argv)
                 pipewarn();
         }
 
-        if (fds[TIMER_FD].revents & POLLIN) {
-            uint64_t expirations = 0;
-            (void)read(fds[TIMER_FD].fd, &expirations, sizeof(expirations));
-
-            if (keyboard.trail_last_mono_ms && keyboard.trail_last_input_ms) {
-                uint64_t now_mono = mono_now_ms();
-                uint64_t delta = now_mono - keyboard.trail_last_mono_ms;
-                keyboard.trail_now_ms =
-                    keyboard.trail_last_input_ms + (uint32_t)delta;
-            }
-            kbd_draw_layout(&keyboard);
-        }
+        if (fds[SWIPE_FD].revents & POLLIN)
+            kbd_swipe_worker_dispatch(&keyboard);
     }
 
+    kbd_swipe_worker_stop(&keyboard);
+
     if (fc_font_pattern) {
         free((void *)fc_font_pattern);
         for (i = 0; i < countof(schemes); i++)
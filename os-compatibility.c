@@ -23,9 +23,9 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
-#include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
@@ -33,6 +33,7 @@
 #include <unistd.h>
 
 #include "os-compatibility.h"
+#include "shm_open.h"
 
 int
 os_fd_set_cloexec(int fd)
@@ -105,93 +106,39 @@ os_epoll_create_cloexec(void)
     return set_cloexec_or_close(fd);
 }
 
-static int
-create_tmpfile_cloexec(char *tmpname)
-{
-    int fd;
-
-#ifdef HAVE_MKOSTEMP
-    fd = mkostemp(tmpname, O_CLOEXEC);
-    if (fd >= 0)
-        unlink(tmpname);
-#else
-    fd = mkstemp(tmpname);
-    if (fd >= 0) {
-        fd = set_cloexec_or_close(fd);
-        unlink(tmpname);
-    }
-#endif
-
-    return fd;
-}
-
 /*
- * Create a new, unique, anonymous file of the given size, and
- * return the file descriptor for it. The file descriptor is set
- * CLOEXEC. The file is immediately suitable for mmap()'ing
- * the given size at offset zero.
- *
- * The file should not have a permanent backing store like a disk,
- * but may have if XDG_RUNTIME_DIR is not properly implemented in OS.
+ * Create an anonymous file holding a copy of the given data, and return
+ * the file descriptor for it. The file descriptor is set CLOEXEC.
  *
- * The file name is deleted from the file system.
- *
- * The file is suitable for buffer sharing between processes by
- * transmitting the file descriptor over Unix sockets using the
- * SCM_RIGHTS methods.
- *
- * If the C library implements posix_fallocate(), it is used to
- * guarantee that disk space is available for the file at the
- * given size. If disk space is insufficient, errno is set to ENOSPC.
- * If posix_fallocate() is not supported, program may receive
- * SIGBUS on accessing mmap()'ed file contents instead.
+ * The file comes from allocate_shm_file(). When it is a memfd it is sealed
+ * against any further modification, so the same descriptor can safely be
+ * handed to the compositor any number of times.
  */
 int
-os_create_anonymous_file(off_t size)
+os_create_sealed_file(const void *data, size_t size)
 {
-    static const char template[] = "/weston-shared-XXXXXX";
-    const char *path;
-    char *name;
+    const char *p = data;
+    size_t written = 0;
+    ssize_t ret;
     int fd;
-    int ret;
-
-    path = getenv("XDG_RUNTIME_DIR");
-    if (!path) {
-        errno = ENOENT;
-        return -1;
-    }
-
-    name = malloc(strlen(path) + sizeof(template));
-    if (!name)
-        return -1;
-
-    strcpy(name, path);
-    strcat(name, template);
-
-    fd = create_tmpfile_cloexec(name);
-
-    free(name);
 
+    fd = allocate_shm_file(size);
     if (fd < 0)
         return -1;
 
-#ifdef HAVE_POSIX_FALLOCATE
-    do {
-        ret = posix_fallocate(fd, 0, size);
-    } while (ret == EINTR);
-    if (ret != 0) {
-        close(fd);
-        errno = ret;
-        return -1;
-    }
-#else
-    do {
-        ret = ftruncate(fd, size);
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-        close(fd);
-        return -1;
+    while (written < size) {
+        ret = write(fd, p + written, size - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            close(fd);
+            return -1;
+        }
+        written += ret;
     }
+
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
 #endif
 
     return fd;
@@ -43,7 +43,7 @@ int os_socketpair_cloexec(int domain, int type, int protocol, int *sv);
 
 int os_epoll_create_cloexec(void);
 
-int os_create_anonymous_file(off_t size);
+int os_create_sealed_file(const void *data, size_t size);
 
 #ifdef MISSING_STRCHRNUL
 char *strchrnul(const char *s, int c);
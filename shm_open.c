@@ -1,11 +1,22 @@
-#define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 
-static void
+#include "shm_open.h"
+
+/* mappings at least this large are worth backing with huge pages */
+#define SHM_HUGEPAGE_MIN (2 * 1024 * 1024)
+
+static bool use_hugepages;
+static size_t bytes_mapped;
+static unsigned long allocations, allocations_reported;
+static struct timespec last_report;
+
+void
 randname(char *buf)
 {
     struct timespec ts;
@@ -18,11 +29,17 @@ randname(char *buf)
     }
 }
 
-static int
+int
 create_shm_file(void)
 {
-    int retries = 100;
     int fd;
+#ifdef MFD_ALLOW_SEALING
+    fd = memfd_create("wvkbd-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0)
+        return fd;
+#endif
+
+    int retries = 100;
     do {
         char name[] = "/wl_shm-XXXXXX";
         randname(name + sizeof(name) - 7);
@@ -36,6 +53,8 @@ create_shm_file(void)
     return -1;
 }
 
+/* The file may still grow, as surface pools do, but never shrink under
+ * the compositor's mapping. */
 int
 allocate_shm_file(size_t size)
 {
@@ -50,5 +69,55 @@ allocate_shm_file(size_t size)
         close(fd);
         return -1;
     }
+#ifdef F_ADD_SEALS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK);
+#endif
+    allocations++;
     return fd;
 }
+
+void *
+map_shm_file(int fd, size_t size)
+{
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+        return data;
+#ifdef MADV_HUGEPAGE
+    if (use_hugepages && size >= SHM_HUGEPAGE_MIN)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    bytes_mapped += size;
+    return data;
+}
+
+void
+unmap_shm_file(void *data, size_t size)
+{
+    munmap(data, size);
+    bytes_mapped -= size;
+}
+
+void
+shm_set_hugepages(bool enable)
+{
+    use_hugepages = enable;
+}
+
+void
+shm_get_stats(struct shm_stats *stats)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - last_report.tv_sec) +
+                     (now.tv_nsec - last_report.tv_nsec) / 1e9;
+
+    stats->bytes_mapped = bytes_mapped;
+    stats->allocations = allocations;
+    stats->allocations_per_sec =
+        (last_report.tv_sec && elapsed > 0)
+            ? (allocations - allocations_reported) / elapsed
+            : 0;
+
+    allocations_reported = allocations;
+    last_report = now;
+}
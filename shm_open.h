@@ -1,8 +1,22 @@
 #ifndef shm_open_h_INCLUDED
 #define shm_open_h_INCLUDED
 
+#include <stdbool.h>
+#include <stddef.h>
+
+struct shm_stats {
+    size_t bytes_mapped;
+    unsigned long allocations;
+    /* since the previous call to shm_get_stats() */
+    double allocations_per_sec;
+};
+
 void randname(char *buf);
 int create_shm_file(void);
 int allocate_shm_file(size_t size);
+void *map_shm_file(int fd, size_t size);
+void unmap_shm_file(void *data, size_t size);
+void shm_set_hugepages(bool enable);
+void shm_get_stats(struct shm_stats *stats);
 
 #endif // shm_open_h_INCLUDED